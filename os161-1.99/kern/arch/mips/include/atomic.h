@@ -0,0 +1,76 @@
+/*
+ * MIPS atomic compare-and-swap and swap, built from LL/SC like
+ * spinlock_data_testandset.
+ */
+
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+unsigned atomic_cas(volatile unsigned *p, unsigned oldval, unsigned newval);
+unsigned atomic_swap(volatile unsigned *p, unsigned newval);
+
+////////////////////////////////////////////////////////////
+
+ATOMIC_INLINE
+unsigned
+atomic_cas(volatile unsigned *p, unsigned oldval, unsigned newval)
+{
+	unsigned x;
+	unsigned y;
+
+	/*
+	 * Load the existing value into X. If it's not OLDVAL, give
+	 * up and return it. Otherwise try to store NEWVAL (via Y);
+	 * after the SC, Y is 1 if the store went through and 0 if
+	 * somebody else got there first, in which case go around
+	 * again. This has to be one asm block so the compiler can't
+	 * put memory accesses between the LL and the SC.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill our own delay slots */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"bne %0, %3, 2f;"	/*   if (x != oldval) goto 2 */
+		" move %1, %4;"		/*   (delay slot) y = newval */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   if (!y) goto 1 */
+		" nop;"			/*   (delay slot) */
+		"2:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (oldval), "r" (newval)
+		: "memory");
+
+	return x;
+}
+
+ATOMIC_INLINE
+unsigned
+atomic_swap(volatile unsigned *p, unsigned newval)
+{
+	unsigned x;
+	unsigned y;
+
+	/*
+	 * Same idea as atomic_cas, but always store NEWVAL.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill our own delay slots */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"move %1, %3;"		/*   y = newval */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   if (!y) goto 1 */
+		" nop;"			/*   (delay slot) */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (newval)
+		: "memory");
+
+	return x;
+}
+
+
+#endif /* _MIPS_ATOMIC_H_ */
@@ -103,6 +103,38 @@ void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 void ram_getsize(paddr_t *lo, paddr_t *hi);
 
+/*
+ * Physical frame allocator (the coremap, in dumbvm.c). Usable once
+ * vm_bootstrap has run; before that getppages falls back on
+ * ram_stealmem.
+ *
+ * coremap_alloc_pages returns the base of NPAGES physically
+ * contiguous frames, or 0 if no free run is long enough.
+ * coremap_free_pages releases a whole run given its base.
+ */
+
+paddr_t coremap_alloc_pages(unsigned long npages);
+void coremap_free_pages(paddr_t paddr);
+
+/*
+ * Kernel virtual memory in kseg2 (vmalloc.c).
+ *
+ * vmalloc builds virtually contiguous buffers out of single frames
+ * and maps them through the TLB, so it keeps working when physical
+ * memory is too fragmented for alloc_kpages. The range below is
+ * carved out of kseg2 for it; each allocation is followed by an
+ * unmapped guard page.
+ *
+ * vmalloc_fault loads the TLB for a fault on a kseg2 address. It
+ * returns EFAULT for addresses that are not currently mapped.
+ */
+
+#define VMALLOC_BASE   MIPS_KSEG2
+#define VMALLOC_PAGES  4096	/* 16M of kernel virtual space */
+
+void vmalloc_bootstrap(void);
+int vmalloc_fault(vaddr_t faultaddress);
+
 /*
  * TLB shootdown bits.
  *
@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
@@ -148,13 +149,35 @@ mips_trap(struct trapframe *tf)
 						+ STACK_SIZE));
 	}
 
+	/*
+	 * The processor has turned interrupts off. Note that in case
+	 * whatever we do here lowers the spl (see spl.c).
+	 */
+	if (CURCPU_EXISTS()) {
+		curcpu->c_irqoff = true;
+	}
+
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
 		bool doadjust;
 
+		/*
+		 * If the recorded state is interrupts off, they were
+		 * only off lazily. Put this one off: return with
+		 * interrupts off in the processor, and it'll come
+		 * back when the spl is lowered. (Unless the idle loop
+		 * is deliberately letting interrupts in; see below.)
+		 */
+		if (curthread->t_iplhigh_count > 0 && !curcpu->c_irqwindow) {
+			KASSERT(iskern);
+			tf->tf_status &= ~(uint32_t)CST_IEp;
+			goto done2;
+		}
+
 		old_in = curthread->t_in_interrupt;
 		curthread->t_in_interrupt = 1;
+		curthread->t_intr_user = !iskern;
 
 		/*
 		 * The processor has turned interrupts off; if the
@@ -163,10 +186,11 @@ mips_trap(struct trapframe *tf)
 		 * restore after processing the interrupt.
 		 *
 		 * How can we get an interrupt if the recorded state
-		 * is interrupts off? Well, as things currently stand
-		 * when the CPU finishes idling it flips interrupts on
-		 * and off to allow things to happen, but leaves
-		 * curspl high while doing so.
+		 * is interrupts off, and not put it off above? Well,
+		 * as things currently stand when the CPU finishes
+		 * idling it flips interrupts on and off to allow
+		 * things to happen, but leaves curspl high while
+		 * doing so.
 		 *
 		 * While we're here, assert that the interrupt
 		 * handling code hasn't leaked a spinlock or an
@@ -194,6 +218,16 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * Don't go back to a user process that's exiting. Put
+		 * interrupts back on first, as below, to clean up.
+		 */
+		if (!iskern && curproc->p_exiting) {
+			spl = splhigh();
+			splx(spl);
+			uthread_exitcheck();
+		}
 		goto done2;
 	}
 
@@ -204,9 +238,9 @@ mips_trap(struct trapframe *tf)
 	 * interrupt, restore the interrupt state to where it was in
 	 * the previous context, which may be low (interrupts on).
 	 *
-	 * Do this by forcing splhigh(), which may do a redundant
-	 * cpu_irqoff() but forces the stored MI interrupt state into
-	 * sync, then restoring the previous state.
+	 * Do this by forcing splhigh(), which forces the stored MI
+	 * interrupt state into sync, then restoring the previous
+	 * state, which turns interrupts back on if it was low.
 	 */
 	spl = splhigh();
 	splx(spl);
@@ -314,6 +348,10 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	if (!iskern) {
+		uthread_exitcheck();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -38,6 +38,7 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include <current.h>
 
 ////////////////////////////////////////////////////////////
 
@@ -219,8 +220,17 @@ wait(void)
 void 
 cpu_idle(void)
 {
+	/*
+	 * We're at splhigh, so interrupts are only off lazily, and
+	 * have to be off for real to wait. The window below takes
+	 * interrupts at splhigh, so mips_trap mustn't put them off.
+	 */
+	cpu_irqoff();
+	curcpu->c_irqoff = true;
 	wait();
+	curcpu->c_irqwindow = true;
         cpu_irqonoff();
+	curcpu->c_irqwindow = false;
 }
 
 /*
@@ -49,6 +49,13 @@
 
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
+#define DUMBVM_STACKSIZE     (DUMBVM_STACKPAGES * PAGE_SIZE)
+
+/*
+ * Thread stacks go one under another down from USERSTACK: stack 0,
+ * the main one, is at the top, and stack N ends where N-1 starts.
+ */
+#define DUMBVM_STACKTOP(slot)	(USERSTACK - (slot) * DUMBVM_STACKSIZE)
 
 /*
  * Wrap rma_stealmem in a spinlock.
@@ -57,20 +64,25 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Coremap related stuff
+ *
+ * One entry per physical frame handed to us by ram_getsize. The
+ * first entry of each allocated run records the length of the run
+ * so that free_kpages can give the whole thing back.
  */
 struct coremap_entry {
-	volatile bool valid;
-	volatile bool fixed;
+	volatile bool valid;		/* frame is in use */
+	volatile uint32_t npages;	/* run length; 0 unless first frame */
 };
 
 static struct coremap_entry *coremap;
 static uint32_t coremap_num_entry;	// total number of entries
 static uint32_t coremap_num_free;		// number of free entries
 static uint32_t pframe_base_addr;	// where the page frame start
+static bool coremap_ready = false;	// set once vm_bootstrap has run
 
 
-#define FRAME_NUM_TO_PADDR(i)	((paddr_t)(pframe_base_addr + i * PAGE_SIZE))
-#define PADDR_TO_FRAME_NUM(paddr)	((paddr - pframe_base_addr) / PAGE_SIZE)
+#define FRAME_NUM_TO_PADDR(i)	((paddr_t)(pframe_base_addr + (i) * PAGE_SIZE))
+#define PADDR_TO_FRAME_NUM(paddr)	(((paddr) - pframe_base_addr) / PAGE_SIZE)
 
 static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 
@@ -120,8 +132,6 @@ vm_bootstrap(void)
 
 	// move up firstaddr pointer
 	first = first + coremap_size;
-
-	uint32_t coremap_num_pages_used = coremap_size / PAGE_SIZE;
 	pframe_base_addr = first;
 
 	coremap_num_entry = (last - first) / PAGE_SIZE;
@@ -129,92 +139,98 @@ vm_bootstrap(void)
 
 	// initialize entries
 	for(uint32_t i = 0; i < coremap_num_entry; i++) {
-		coremap[i].valid = 0;
-		if(i < coremap_num_pages_used) {
-			coremap[i].fixed = 1;
-		} else {
-			coremap[i].fixed = 0;
-		}
+		coremap[i].valid = false;
+		coremap[i].npages = 0;
 	}
 
+	coremap_ready = true;
+
+	vmalloc_bootstrap();
 }
 
-static
+/*
+ * Allocate NPAGES physically contiguous frames from the coremap.
+ * First fit. Returns 0 if there is no free run long enough.
+ */
 paddr_t
-coremap_page_replace(void) {
-	int32_t rand_page = (random() % coremap_num_entry);
-	return rand_page;
-}
+coremap_alloc_pages(unsigned long npages)
+{
+	uint32_t i, start, run;
 
-// static
-// paddr_t
-// coremap_alloc_single_page(void) {
-// 	paddr_t page = 0xdeadbeef;
-// 	bool iskern = (curproc->pid == 1) ? true : false;
-
-// 	spinlock_acquire(&coremap_spinlock);
-
-// 	if (coremap_num_free > 0) {
-
-// 		for (uint32_t i = 0; i < coremap_num_entry; i++) {
-// 			if (coremap[i].valid || coremap[i].fixed) {
-// 				continue;
-// 			}
-// 			page = i;
-// 			break;
-// 		}
-// 	}
-
-// 	if (page != 0xdeadbeef && curthread != NULL) {
-// 		page = coremap_page_replace();
-// 	}
-
-// 	coremap[page].valid = true;
-// 	if(iskern) {
-// 		coremap[page].fixed = true;
-// 	}
-// 	spinlock_release(&coremap_spinlock);
-// 	return FRAME_NUM_TO_PADDR(page);
-// }
+	KASSERT(npages > 0);
 
-static
-paddr_t
-coremap_alloc_pages(int32_t npages) {
-	int32_t page = -1;
-	bool iskern = (curproc->pid == 1) ? true : false;
-	int32_t num_cont_pages = 0;
 	spinlock_acquire(&coremap_spinlock);
 
-	if (coremap_num_free > 0) {
-
-		for (uint32_t i = 0; i < coremap_num_entry; i++) {
-			if (coremap[i].valid || coremap[i].fixed) {
-				num_cont_pages = 0;
-				continue;
-			}
-			num_cont_pages++;
-			if(num_cont_pages == npages) {
-				page = i;
-				
-			} else {
-				continue;
-			}
+	if (coremap_num_free < npages) {
+		spinlock_release(&coremap_spinlock);
+		return 0;
+	}
+
+	run = 0;
+	start = 0;
+	for (i = 0; i < coremap_num_entry; i++) {
+		if (coremap[i].valid) {
+			run = 0;
+			continue;
+		}
+		if (run == 0) {
+			start = i;
+		}
+		run++;
+		if (run == npages) {
 			break;
 		}
 	}
 
-	if (page < 0 && curthread != NULL) {
-		page = coremap_page_replace();
+	if (run < npages) {
+		spinlock_release(&coremap_spinlock);
+		return 0;
 	}
 
-	coremap[page].valid = true;
-	if(iskern) {
-		coremap[page].fixed = true;
+	for (i = start; i < start + npages; i++) {
+		KASSERT(!coremap[i].valid);
+		coremap[i].valid = true;
+		coremap[i].npages = 0;
 	}
+	coremap[start].npages = npages;
+	coremap_num_free -= npages;
 
 	spinlock_release(&coremap_spinlock);
 
-	return FRAME_NUM_TO_PADDR(page);
+	return FRAME_NUM_TO_PADDR(start);
+}
+
+/*
+ * Give back a run of frames allocated by coremap_alloc_pages.
+ * Memory stolen before vm_bootstrap is not tracked and is ignored.
+ */
+void
+coremap_free_pages(paddr_t paddr)
+{
+	uint32_t i, frame, npages;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (!coremap_ready || paddr < pframe_base_addr) {
+		return;
+	}
+
+	frame = PADDR_TO_FRAME_NUM(paddr);
+	KASSERT(frame < coremap_num_entry);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	npages = coremap[frame].npages;
+	KASSERT(coremap[frame].valid);
+	KASSERT(npages > 0);
+
+	for (i = frame; i < frame + npages; i++) {
+		coremap[i].valid = false;
+		coremap[i].npages = 0;
+	}
+	coremap_num_free += npages;
+
+	spinlock_release(&coremap_spinlock);
 }
 
 static
@@ -223,6 +239,10 @@ getppages(unsigned long npages)
 {
 	paddr_t addr;
 
+	if (coremap_ready) {
+		return coremap_alloc_pages(npages);
+	}
+
 	spinlock_acquire(&stealmem_lock);
 
 	addr = ram_stealmem(npages);
@@ -246,30 +266,41 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
-	// paddr_t paddr = KVADDR_TO_PADDR(addr);
-
-	// int32_t coremap_index = PADDR_TO_FRAME_NUM(paddr);
-
-	// spinlock_acquire(&coremap_spinlock);
-
-	// if(!coremap[coremap_index].fixed) {
-	// 	coremap[coremap_index].valid = 0;
-	// }
-	(void)addr;
+	/* kmalloc falls back to vmalloc for big blocks; see kmalloc.c */
+	if (addr >= MIPS_KSEG2) {
+		vfree((void *)addr);
+		return;
+	}
+	coremap_free_pages(KVADDR_TO_PADDR(addr));
 }
 
+/*
+ * The only mappings we ever shoot down are kernel (kseg2) ones from
+ * vfree; user mappings are thrown away wholesale by as_activate.
+ */
 void
 vm_tlbshootdown_all(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
-	coremap_alloc_pages(1);
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(ts->ts_vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
 }
 
 int
@@ -277,6 +308,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
+	unsigned slot;
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
@@ -287,6 +319,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
+	/* Kernel virtual memory handed out by vmalloc */
+	if (faultaddress >= MIPS_KSEG2) {
+		return vmalloc_fault(faultaddress);
+	}
+
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
 		/* We always create pages read-write, so we can't get this */
@@ -349,6 +386,17 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 		seg = 2;
 	}
+	else if (faultaddress >= DUMBVM_STACKTOP(AS_MAXSTACKS) &&
+		 faultaddress < stackbase) {
+		/* Another thread's stack, if it has one */
+		slot = (USERSTACK - 1 - faultaddress) / DUMBVM_STACKSIZE;
+		if (as->as_tstackpbase[slot] == 0) {
+			return EFAULT;
+		}
+		stackbase = DUMBVM_STACKTOP(slot + 1);
+		paddr = (faultaddress - stackbase) + as->as_tstackpbase[slot];
+		seg = 2;
+	}
 	else {
 		return EFAULT;
 	}
@@ -371,6 +419,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
 		}
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+		/* All our faults are minor; there's no paging. */
+		curthread->t_usage.tu_minflt++;
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
@@ -383,6 +433,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
 	}
 	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	curthread->t_usage.tu_minflt++;
 	tlb_random(ehi, elo);
 	splx(spl);
 	return 0;
@@ -408,6 +459,7 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	bzero(as->as_tstackpbase, sizeof(as->as_tstackpbase));
 
 	as->as_page_table = NULL;
 	return as;
@@ -416,6 +468,23 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	unsigned i;
+
+	if (as->as_pbase1 != 0) {
+		coremap_free_pages(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free_pages(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free_pages(as->as_stackpbase);
+	}
+	for (i=1; i<AS_MAXSTACKS; i++) {
+		if (as->as_tstackpbase[i] != 0) {
+			coremap_free_pages(as->as_tstackpbase[i]);
+		}
+	}
+	kfree(as->as_page_table);
 	kfree(as);
 }
 
@@ -546,10 +615,44 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Thread stacks are never freed before the address space is, so no
+ * other cpu can be left with a TLB entry for a stack that's gone.
+ * The caller serializes calls for the same address space.
+ */
+int
+as_define_thread_stack(struct addrspace *as, unsigned slot, vaddr_t *stackptr)
+{
+	vaddr_t stackbase;
+	paddr_t paddr;
+
+	KASSERT(slot > 0 && slot < AS_MAXSTACKS);
+	KASSERT(as->as_stackpbase != 0);
+
+	if (as->as_tstackpbase[slot] == 0) {
+		stackbase = DUMBVM_STACKTOP(slot + 1);
+		if (stackbase < as->as_vbase1 + as->as_npages1 * PAGE_SIZE ||
+		    stackbase < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+			/* Would run into the program */
+			return ENOMEM;
+		}
+		paddr = getppages(DUMBVM_STACKPAGES);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		as_zero_region(paddr, DUMBVM_STACKPAGES);
+		as->as_tstackpbase[slot] = paddr;
+	}
+
+	*stackptr = DUMBVM_STACKTOP(slot);
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	unsigned i;
 
 	new = as_create();
 	if (new==NULL) {
@@ -582,6 +685,24 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+	/*
+	 * Copy the other threads' stacks too; the thread calling fork
+	 * might be running on one of them.
+	 */
+	for (i=1; i<AS_MAXSTACKS; i++) {
+		if (old->as_tstackpbase[i] == 0) {
+			continue;
+		}
+		new->as_tstackpbase[i] = getppages(DUMBVM_STACKPAGES);
+		if (new->as_tstackpbase[i] == 0) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(new->as_tstackpbase[i]),
+			(const void *)PADDR_TO_KVADDR(old->as_tstackpbase[i]),
+			DUMBVM_STACKPAGES*PAGE_SIZE);
+	}
 	
 	*ret = new;
 	return 0;
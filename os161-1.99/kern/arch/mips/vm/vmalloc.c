@@ -0,0 +1,374 @@
+/*
+ * Virtually contiguous kernel allocations.
+ *
+ * alloc_kpages needs physically contiguous frames, and after the
+ * system has been up for a while the coremap tends to be too
+ * fragmented to supply them even with plenty of memory free. vmalloc
+ * instead grabs single frames wherever they are and strings them
+ * together in kseg2, which on MIPS is kernel space translated by the
+ * TLB. Misses on kseg2 come through vm_fault to vmalloc_fault, which
+ * loads the translation from the table below.
+ *
+ * Because the exception entry code runs on the kernel stack, a stack
+ * in kseg2 could take a TLB miss while saving the trapframe; so
+ * stacks (which are one page and never need this anyway) must keep
+ * coming from kseg0.
+ *
+ * The frames of a freed allocation can't be reused until every CPU
+ * has flushed its translations for them. vfree posts the shootdowns
+ * and, if it can, waits for them to be done before freeing the
+ * frames. A caller holding a spinlock or in an interrupt can't wait
+ * (the CPU it would wait for might be waiting for it), so its pages
+ * are just marked freed and left for the next vfree or vmalloc that
+ * can.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <vm.h>
+
+/*
+ * One entry per page of the kseg2 window. vp_paddr is 0 when the
+ * page is not mapped. vp_npages is set on the first page of each
+ * allocation to its size in pages, not counting the guard page.
+ * vp_freed is 0 while the allocation is live, and one more than the
+ * vmalloc_epoch it was vfreed in while its frames wait to be freed.
+ */
+struct vmalloc_pte {
+	paddr_t vp_paddr;
+	unsigned vp_npages;
+	unsigned vp_freed;
+};
+
+static struct vmalloc_pte *vmalloc_ptes;
+static unsigned vmalloc_pages_used;	/* mapped pages, for stats */
+static unsigned vmalloc_pages_freed;	/* ...of which vfreed */
+static unsigned vmalloc_epoch;		/* See vmalloc_reclaim */
+
+/* The guard page belongs to the allocation but is never mapped. */
+#define VMALLOC_GUARD 1
+
+#define VMALLOC_VADDR(i)   ((vaddr_t)(VMALLOC_BASE + (i) * PAGE_SIZE))
+#define VMALLOC_INDEX(va)  (((va) - VMALLOC_BASE) / PAGE_SIZE)
+
+/* Protects vmalloc_ptes; nests outside the coremap spinlock. */
+static struct spinlock vmalloc_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Set up the page table for the kseg2 window. Called at the end of
+ * vm_bootstrap, so the table itself comes from the coremap.
+ */
+void
+vmalloc_bootstrap(void)
+{
+	size_t size;
+	paddr_t pa;
+	unsigned i;
+
+	size = VMALLOC_PAGES * sizeof(struct vmalloc_pte);
+	pa = coremap_alloc_pages(DIVROUNDUP(size, PAGE_SIZE));
+	if (pa == 0) {
+		panic("vmalloc_bootstrap: no memory for page table\n");
+	}
+	vmalloc_ptes = (struct vmalloc_pte *)PADDR_TO_KVADDR(pa);
+
+	for (i=0; i<VMALLOC_PAGES; i++) {
+		vmalloc_ptes[i].vp_paddr = 0;
+		vmalloc_ptes[i].vp_npages = 0;
+		vmalloc_ptes[i].vp_freed = 0;
+	}
+	vmalloc_pages_used = 0;
+	vmalloc_pages_freed = 0;
+	vmalloc_epoch = 0;
+}
+
+/*
+ * True if we may wait for other CPUs here: interrupts on, so nobody
+ * can be waiting for us meanwhile.
+ */
+static
+bool
+vmalloc_canwait(void)
+{
+	return !curthread->t_in_interrupt && curthread->t_iplhigh_count == 0;
+}
+
+/*
+ * Give back the frames of the vfreed allocation at START. Lock held.
+ */
+static
+void
+vmalloc_unmap(unsigned start)
+{
+	unsigned npages, i;
+
+	npages = vmalloc_ptes[start].vp_npages;
+	for (i=0; i<npages; i++) {
+		KASSERT(vmalloc_ptes[start+i].vp_paddr != 0);
+		KASSERT(vmalloc_ptes[start+i].vp_freed != 0);
+		coremap_free_pages(vmalloc_ptes[start+i].vp_paddr);
+		vmalloc_ptes[start+i].vp_paddr = 0;
+		vmalloc_ptes[start+i].vp_freed = 0;
+	}
+	vmalloc_ptes[start].vp_npages = 0;
+	vmalloc_pages_used -= npages;
+	vmalloc_pages_freed -= npages;
+}
+
+/*
+ * Free the frames of vfreed allocations, once every CPU has flushed
+ * them. vfree marks its pages and posts its shootdowns in one go
+ * under the lock, so everything marked before we bump the epoch has
+ * been posted before ipi_tlbshootdown_wait looks; anything marked
+ * after may not have been, and is left for next time.
+ */
+static
+void
+vmalloc_reclaim(void)
+{
+	unsigned cutoff, i, npages;
+
+	spinlock_acquire(&vmalloc_spinlock);
+	if (vmalloc_pages_freed == 0) {
+		spinlock_release(&vmalloc_spinlock);
+		return;
+	}
+	cutoff = ++vmalloc_epoch;
+	spinlock_release(&vmalloc_spinlock);
+
+	ipi_tlbshootdown_wait();
+
+	spinlock_acquire(&vmalloc_spinlock);
+	i = 0;
+	while (i < VMALLOC_PAGES) {
+		npages = vmalloc_ptes[i].vp_npages;
+		if (npages == 0) {
+			i++;
+			continue;
+		}
+		if (vmalloc_ptes[i].vp_freed != 0 &&
+		    vmalloc_ptes[i].vp_freed <= cutoff) {
+			vmalloc_unmap(i);
+		}
+		i += npages + VMALLOC_GUARD;
+	}
+	spinlock_release(&vmalloc_spinlock);
+}
+
+/*
+ * Find NPAGES free entries in a row, first fit. Live allocations are
+ * stepped over as a whole from their first entry, which also skips
+ * their guard page (unmapped, so it looks free otherwise). Call with
+ * vmalloc_spinlock held. Returns VMALLOC_PAGES on failure.
+ */
+static
+unsigned
+vmalloc_findrun(unsigned npages)
+{
+	unsigned i, run, start;
+
+	run = 0;
+	start = 0;
+	i = 0;
+	while (i < VMALLOC_PAGES) {
+		if (vmalloc_ptes[i].vp_npages > 0) {
+			/* skip the whole allocation and its guard */
+			i += vmalloc_ptes[i].vp_npages + VMALLOC_GUARD;
+			run = 0;
+			continue;
+		}
+		if (run == 0) {
+			start = i;
+		}
+		run++;
+		if (run == npages) {
+			return start;
+		}
+		i++;
+	}
+	return VMALLOC_PAGES;
+}
+
+void *
+vmalloc(size_t size)
+{
+	unsigned npages, start, i;
+	paddr_t pa;
+
+	if (size == 0) {
+		return NULL;
+	}
+	npages = DIVROUNDUP(size, PAGE_SIZE);
+	if (npages + VMALLOC_GUARD > VMALLOC_PAGES) {
+		return NULL;
+	}
+
+	/* Unlocked peek; it's only a hint. */
+	if (vmalloc_pages_freed > 0 && vmalloc_canwait()) {
+		vmalloc_reclaim();
+	}
+
+	spinlock_acquire(&vmalloc_spinlock);
+
+	start = vmalloc_findrun(npages + VMALLOC_GUARD);
+	if (start == VMALLOC_PAGES) {
+		spinlock_release(&vmalloc_spinlock);
+		return NULL;
+	}
+
+	for (i=0; i<npages; i++) {
+		pa = coremap_alloc_pages(1);
+		if (pa == 0) {
+			/* Out of frames; undo what we have so far. */
+			while (i > 0) {
+				i--;
+				coremap_free_pages(vmalloc_ptes[start+i].vp_paddr);
+				vmalloc_ptes[start+i].vp_paddr = 0;
+			}
+			spinlock_release(&vmalloc_spinlock);
+			return NULL;
+		}
+		vmalloc_ptes[start+i].vp_paddr = pa;
+	}
+	vmalloc_ptes[start].vp_npages = npages;
+	vmalloc_pages_used += npages;
+
+	spinlock_release(&vmalloc_spinlock);
+
+	return (void *)VMALLOC_VADDR(start);
+}
+
+/*
+ * Drop a kseg2 translation from this CPU's TLB and ask the others
+ * to do the same. Lock held, which also keeps us on this CPU.
+ */
+static
+void
+vmalloc_shootdown(vaddr_t va, unsigned npages)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	unsigned i;
+
+	if (npages > TLBSHOOTDOWN_MAX) {
+		vm_tlbshootdown_all();
+		ipi_tlbshootdown_broadcast(NULL);
+		return;
+	}
+	for (i=0; i<npages; i++) {
+		ts[i].ts_addrspace = NULL;
+		ts[i].ts_vaddr = va + i * PAGE_SIZE;
+		vm_tlbshootdown(&ts[i]);
+	}
+	ipi_tlbshootdown_broadcast_many(ts, npages);
+}
+
+void
+vfree(void *ptr)
+{
+	vaddr_t va = (vaddr_t)ptr;
+	unsigned start, npages, i;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	KASSERT(va >= VMALLOC_BASE);
+	KASSERT((va & PAGE_FRAME) == va);
+	start = VMALLOC_INDEX(va);
+	KASSERT(start < VMALLOC_PAGES);
+
+	spinlock_acquire(&vmalloc_spinlock);
+	npages = vmalloc_ptes[start].vp_npages;
+	if (npages == 0 || vmalloc_ptes[start].vp_freed != 0) {
+		panic("vfree: %p was not allocated by vmalloc\n", ptr);
+	}
+
+	/*
+	 * Stop vmalloc_fault from loading the translations again, and
+	 * flush them. The frames stay ours until vmalloc_reclaim has
+	 * seen every CPU do so, so no CPU can write through a stale
+	 * mapping into someone else's memory.
+	 */
+	for (i=0; i<npages; i++) {
+		vmalloc_ptes[start+i].vp_freed = vmalloc_epoch + 1;
+	}
+	vmalloc_pages_freed += npages;
+	vmalloc_shootdown(va, npages);
+	spinlock_release(&vmalloc_spinlock);
+
+	if (vmalloc_canwait()) {
+		vmalloc_reclaim();
+	}
+}
+
+/*
+ * Handle a TLB miss on a kseg2 address. The table entry of a live
+ * allocation doesn't change until it is freed, so it is read
+ * without the lock; touching memory that is being freed is a bug
+ * whichever way that race goes.
+ */
+int
+vmalloc_fault(vaddr_t faultaddress)
+{
+	unsigned index;
+	paddr_t paddr;
+	uint32_t ehi, elo;
+	int i, spl;
+
+	if (faultaddress < VMALLOC_BASE) {
+		return EFAULT;
+	}
+	index = VMALLOC_INDEX(faultaddress);
+	if (vmalloc_ptes == NULL || index >= VMALLOC_PAGES) {
+		return EFAULT;
+	}
+	paddr = vmalloc_ptes[index].vp_paddr;
+	if (paddr == 0 || vmalloc_ptes[index].vp_freed != 0) {
+		/* unmapped, a guard page, or freed: overrun or use after free */
+		return EFAULT;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	ehi = faultaddress;
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+
+	/* Another thread on this CPU may have loaded it already. */
+	if (tlb_probe(ehi, 0) >= 0) {
+		splx(spl);
+		return 0;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+		uint32_t oldehi, oldelo;
+
+		tlb_read(&oldehi, &oldelo, i);
+		if (oldelo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return 0;
+	}
+	tlb_random(ehi, elo);
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Report how much of the kseg2 window is in use.
+ */
+void
+vmalloc_printstats(void)
+{
+	kprintf("vmalloc: %u of %u pages mapped (%u freed, awaiting flush)\n",
+		vmalloc_pages_used, VMALLOC_PAGES, vmalloc_pages_freed);
+}
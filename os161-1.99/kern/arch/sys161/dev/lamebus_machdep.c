@@ -242,6 +242,27 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Program the on-chip timer. The longest interval c0_compare can
+ * express is a little under three minutes at 25 MHz, which is what
+ * "off" (0) and anything too long turn into; a spurious hardclock that
+ * often is harmless.
+ */
+void
+mainbus_settimer(unsigned hardclocks)
+{
+	const uint32_t cyclesperhz = CPU_FREQUENCY / HZ;
+	uint32_t count;
+
+	if (hardclocks == 0 || hardclocks > 0xffffffff / cyclesperhz) {
+		count = 0xffffffff;
+	}
+	else {
+		count = hardclocks * cyclesperhz;
+	}
+	mips_timer_set(count);
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -264,13 +285,20 @@ mainbus_interrupt(struct trapframe *tf)
 		lamebus_interrupt(lamebus);
 	}
 	else if (cause & LAMEBUS_IPI_BIT) {
-		interprocessor_interrupt();
+		/*
+		 * Acknowledge first: anything posted after this
+		 * either gets seen by interprocessor_interrupt or
+		 * sends a new IPI (see ipi_post).
+		 */
 		lamebus_clear_ipi(lamebus, curcpu);
+		interprocessor_interrupt();
 	}
 	else if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
+		/*
+		 * Call hardclock. It resets the timer (which clears
+		 * the interrupt) for however long it wants the next
+		 * tick to be.
+		 */
 		hardclock();
 	}
 	else {
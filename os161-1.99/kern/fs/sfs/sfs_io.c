@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -67,13 +68,20 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		panic("sfs: d_io returned EINVAL\n");
 	}
 	if (result == EIO) {
+		/*
+		 * Back off before retrying, doubling the wait each
+		 * time (1, 2, 4, ... hardclocks), to give a device
+		 * that's having transient trouble a chance to recover.
+		 */
 		if (tries == 0) {
 			tries++;
 			kprintf("sfs: block %llu I/O error, retrying\n",
 				uio->uio_offset / SFS_BLOCKSIZE);
+			clocksleep_ticks(1);
 			goto retry;
 		}
 		else if (tries < 10) {
+			clocksleep_ticks(1U << tries);
 			tries++;
 			goto retry;
 		}
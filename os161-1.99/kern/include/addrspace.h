@@ -51,6 +51,9 @@ struct page_table_entry {
  * You write this.
  */
 
+/* Stacks per address space, one for each user thread */
+#define AS_MAXSTACKS 16
+
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -59,6 +62,7 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+  paddr_t as_tstackpbase[AS_MAXSTACKS];	/* [0] unused; that's as_stackpbase */
 
   struct page_table_entry *as_page_table;
   int32_t as_page_table_size;
@@ -98,6 +102,11 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_thread_stack - set up stack number SLOT (1 and up; 0 is
+ *                the one from as_define_stack) for another user thread,
+ *                and hand back its initial stack pointer. A slot's
+ *                stack is kept once made, and reused by later threads.
  */
 
 struct addrspace *as_create(void);
@@ -114,6 +123,8 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_thread_stack(struct addrspace *as, unsigned slot,
+                                         vaddr_t *stackptr);
 
 
 /*
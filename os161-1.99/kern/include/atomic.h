@@ -0,0 +1,52 @@
+/*
+ * Atomic operations on memory words, for lock-free fast paths.
+ * The guts are machine-dependent.
+ *
+ * atomic_cas	If *P is OLDVAL, replace it with NEWVAL. Either way,
+ *		return the value *P had; the swap happened if that's
+ *		OLDVAL.
+ *
+ * atomic_swap	Replace *P with NEWVAL, and return the value it had.
+ *
+ * atomic_casptr and atomic_swapptr are the same things for pointers.
+ *
+ * These do not touch the interrupt state, and imply no ordering
+ * beyond what the (sequentially consistent) System/161 memory
+ * provides anyway.
+ */
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#include <cdefs.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+/* Get the machine-dependent bits. */
+#include <machine/atomic.h>
+
+void *atomic_casptr(void *volatile *p, void *oldval, void *newval);
+void *atomic_swapptr(void *volatile *p, void *newval);
+
+ATOMIC_INLINE
+void *
+atomic_casptr(void *volatile *p, void *oldval, void *newval)
+{
+	COMPILE_ASSERT(sizeof(void *) == sizeof(unsigned));
+	return (void *)atomic_cas((volatile unsigned *)p,
+				  (unsigned)oldval, (unsigned)newval);
+}
+
+ATOMIC_INLINE
+void *
+atomic_swapptr(void *volatile *p, void *newval)
+{
+	COMPILE_ASSERT(sizeof(void *) == sizeof(unsigned));
+	return (void *)atomic_swap((volatile unsigned *)p, (unsigned)newval);
+}
+
+
+#endif /* _ATOMIC_H_ */
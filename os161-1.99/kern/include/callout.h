@@ -0,0 +1,79 @@
+#ifndef _CALLOUT_H_
+#define _CALLOUT_H_
+
+/*
+ * Callouts: functions to be called from the timer interrupt at some
+ * number of hardclock ticks in the future.
+ *
+ * Each cpu keeps a hierarchical timing wheel (see callout.c) and a
+ * callout fires on the cpu that scheduled it. Callout functions run
+ * in interrupt context with interrupts off: they may take spinlocks
+ * and wake threads up, but may not sleep.
+ *
+ * struct callout is public so it can be embedded in other structures
+ * (or on the stack); don't poke at its fields.
+ */
+
+#include <spinlock.h>
+
+struct cpu;
+
+struct callout {
+	struct callout *co_next;	/* Next in wheel slot */
+	struct callout **co_prevp;	/* Link to us; NULL if not pending */
+	uint64_t co_expire;		/* Tick at which to fire */
+	struct cpu *co_cpu;		/* Wheel we were last put on */
+	void (*co_func)(void *);	/* Function to call */
+	void *co_arg;			/* Its argument */
+};
+
+/*
+ * The wheel: CALLOUT_LEVELS levels of CALLOUT_SLOTS slots. Level 0
+ * slots are one tick wide, level 1 slots CALLOUT_SLOTS ticks, and so
+ * on; anything further out than the top level reaches is clamped.
+ */
+#define CALLOUT_SLOTBITS	6
+#define CALLOUT_SLOTS		(1 << CALLOUT_SLOTBITS)
+#define CALLOUT_LEVELS		4
+#define CALLOUT_MAXTICKS	((1U << (CALLOUT_SLOTBITS*CALLOUT_LEVELS)) - 1)
+
+struct callout_wheel {
+	struct spinlock cw_lock;
+	uint64_t cw_now;			/* Next tick to process */
+	unsigned cw_count;			/* Callouts pending */
+	struct callout *volatile cw_running;	/* Callout being run */
+	struct callout *cw_slots[CALLOUT_LEVELS][CALLOUT_SLOTS];
+};
+
+/*
+ * Callout functions.
+ *
+ * callout_init		Set up a callout to call FUNC(ARG).
+ * callout_schedule	Arrange for the callout to fire TICKS hardclocks
+ *			from now on the current cpu. If it was already
+ *			pending, it's rescheduled.
+ * callout_stop		Cancel a callout. Returns true if it was pending
+ *			and now won't fire; false if it wasn't pending.
+ *			If it is firing on another cpu, waits for the
+ *			function to return first, so the callout's
+ *			memory may be reused afterwards. Don't call it
+ *			holding a lock the callout function takes.
+ *
+ * callout_wheel_init	Initialize a cpu's wheel (called by cpu_create).
+ * callout_hardclock	Run whatever is due on this cpu. Called by
+ *			hardclock.
+ * callout_nextevent	Number of ticks until this cpu might next have
+ *			something to run, or 0 if nothing is pending.
+ * callout_clock	The current time, in hardclock ticks since boot.
+ */
+void callout_init(struct callout *co, void (*func)(void *), void *arg);
+void callout_schedule(struct callout *co, unsigned ticks);
+bool callout_stop(struct callout *co);
+
+void callout_wheel_init(struct callout_wheel *w);
+void callout_hardclock(void);
+unsigned callout_nextevent(void);
+uint64_t callout_clock(void);
+
+
+#endif /* _CALLOUT_H_ */
@@ -32,6 +32,7 @@
 
 
 #include <spinlock.h>
+#include <callout.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
@@ -58,15 +59,32 @@ struct cpu {
 	 * Accessed only by this cpu.
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
+	struct thread *c_idlethread;	/* Runs when the last one leaves */
+	struct thread *c_leaving;	/* Switched away from, moving cpus */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadpool;	/* Exited threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct callout_wheel c_callouts; /* Timers scheduled on this cpu */
+	bool c_irqoff;			/* Irqs may be off in hw; see spl.c */
+	bool c_irqwindow;		/* Idle code is letting irqs in */
+
+	/*
+	 * Queue entries for spinlocks this cpu holds or is waiting
+	 * for. The next cpu in line for a lock links itself onto our
+	 * entry, and we clear its sn_wait; see spinlock.c.
+	 */
+	struct spinlock_node c_spinnodes[SPINLOCK_MAXHELD];
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+	unsigned c_tickinterval;	/* Hardclocks per timer irq; 0 = off */
+	uint64_t c_tickstart;		/* When a busy stretch began, or 0 */
+	unsigned c_tickcarry;		/* Stretch cut short, not yet charged */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	uint64_t c_pass;		/* Highest t_pass run so far */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -82,10 +100,23 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_ipi_pending being nonzero also means an IPI is on its way
+	 * to this cpu that hasn't been picked up yet, so requests made
+	 * meanwhile just add their bits (see ipi_post).
+	 *
+	 * c_shootdown_req counts the shootdowns queued for this cpu,
+	 * and c_shootdown_done is what that count was when it last
+	 * flushed, so a sender can wait for its requests to be done
+	 * (ipi_tlbshootdown_wait).
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_req;
+	unsigned c_shootdown_done;
+	unsigned c_ipi_sent;		/* IPIs actually sent to us */
+	unsigned c_ipi_coalesced;	/* Requests folded into one of those */
 	struct spinlock c_ipi_lock;
 };
 
@@ -152,6 +183,18 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current
+ * one; a null mapping asks for the whole TLB to be flushed.
+ * ipi_tlbshootdown_broadcast_many does the same for N mappings at
+ * once, with one IPI per CPU. These only post the requests;
+ * ipi_tlbshootdown_wait waits until every CPU has carried out all
+ * those posted to it so far. It must be called with interrupts on,
+ * so the others can't be stuck waiting for this CPU meanwhile.
+ *
+ * Requests to a CPU that already has an IPI outstanding are
+ * coalesced into that one rather than sending another.
+ * ipi_printstats prints how many IPIs each CPU was sent, and how
+ * many requests were coalesced.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +209,11 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_broadcast_many(const struct tlbshootdown *mappings,
+				     unsigned n);
+void ipi_tlbshootdown_wait(void);
+void ipi_printstats(void);
 
 void interprocessor_interrupt(void);
 
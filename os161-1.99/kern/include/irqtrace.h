@@ -0,0 +1,64 @@
+#ifndef _IRQTRACE_H_
+#define _IRQTRACE_H_
+
+/*
+ * Interrupt-off latency tracer ("options irqtrace").
+ *
+ * When compiled in, the spl code timestamps each stretch a cpu spends
+ * at IPL_HIGH, from the raise that takes t_iplhigh_count off zero to
+ * the lower that brings it back, and spinlock_acquire/release do the
+ * same for each spinlock hold. Interrupts (including the timer, and
+ * so preemption) can't be taken during either, so these are the
+ * latencies a device or a newly runnable thread may see.
+ *
+ * Each cpu keeps its IRQTRACE_WORST longest intervals of each kind,
+ * with the address that raised the level or took the lock. Time spent
+ * waiting in cpu_idle, where interrupts are really on, isn't counted.
+ * Neither is time in the trap handler itself, which runs at IPL_HIGH
+ * without going through splraise.
+ *
+ * Like lockstat, collection is off until turned on from the menu
+ * ("irqtrace on"), which also keeps it off the clock until the clock
+ * is attached. Timing comes from gettime, so it's as fine-grained as
+ * the ltimer device, but reading the clock isn't free and inflates
+ * the short intervals somewhat.
+ *
+ * When not compiled in, none of this exists.
+ */
+
+#include "opt-irqtrace.h"
+
+#if OPT_IRQTRACE
+
+#define IRQTRACE_WORST	8	/* Records kept per cpu, per kind */
+
+struct spinlock_node;
+
+/* True while collecting. */
+extern volatile bool irqtrace_enabled;
+
+/*
+ * Called by splraise as the level goes up from IPL_NONE, and by
+ * spllower just before it comes back down; and around cpu_idle.
+ */
+void irqtrace_off(void);
+void irqtrace_on(void);
+
+/*
+ * Called by whatever just raised the level with the address to blame
+ * for it. Only the raise that started the interval counts.
+ */
+void irqtrace_site(const void *site);
+
+/* Called by spinlock_acquire once it has the lock, and by release. */
+void irqtrace_spinacquire(struct spinlock_node *node, const void *site);
+void irqtrace_spinrelease(struct spinlock_node *node);
+
+/* Menu interface. */
+void irqtrace_reset(void);
+void irqtrace_report(void);
+
+#endif /* OPT_IRQTRACE */
+
+
+#endif /* _IRQTRACE_H_ */
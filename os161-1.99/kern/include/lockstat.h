@@ -0,0 +1,68 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics ("options lockstat").
+ *
+ * When compiled in, spinlock_acquire, lock_acquire, P and cv_wait
+ * record, per lock: acquisitions, how many of those had to wait, how
+ * many times they went around a spin loop, and total time spent
+ * asleep waiting; for spinlocks and locks also total and worst time
+ * held. Locks, semaphores and CVs are identified by name, so all
+ * instances with the same name add up together; spinlocks have no
+ * name and are identified by the address spinlock_acquire was called
+ * from.
+ *
+ * Collection is off until turned on from the menu ("lockstat on"),
+ * which also avoids touching the clock before it's attached.
+ *
+ * When not compiled in, none of this exists and the lock code is
+ * exactly as it would be otherwise.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+/* Kinds of lock */
+#define LOCKSTAT_SPINLOCK	0
+#define LOCKSTAT_LOCK		1
+#define LOCKSTAT_SEM		2
+#define LOCKSTAT_CV		3
+
+struct lockstat;	/* Opaque */
+
+/* True while collecting. */
+extern volatile bool lockstat_enabled;
+
+/*
+ * Find (or create) the record for a lock. These return NULL when
+ * collection is off or the table is full; the other functions must
+ * only be called with a non-NULL record.
+ *
+ * lockstat_named caches the record in *CACHE, which should live in
+ * the lock structure and start out NULL. Records are never freed or
+ * reused, so the cached pointer stays good.
+ */
+struct lockstat *lockstat_site(unsigned kind, const void *site);
+struct lockstat *lockstat_named(struct lockstat **cache, unsigned kind,
+				const char *name);
+
+/* The time in nanoseconds, for the SINCE arguments. */
+uint64_t lockstat_now(void);
+
+/* Record an acquisition, and whether and how long it spun. */
+void lockstat_acquire(struct lockstat *ls, bool contended, unsigned spins);
+/* Record time spent asleep waiting, from SINCE until now. */
+void lockstat_sleep(struct lockstat *ls, uint64_t since);
+/* Record time held, from SINCE until now. */
+void lockstat_hold(struct lockstat *ls, uint64_t since);
+
+/* Menu interface. */
+void lockstat_reset(void);
+void lockstat_report(const char *sortkey);
+
+#endif /* OPT_LOCKSTAT */
+
+
+#endif /* _LOCKSTAT_H_ */
@@ -55,6 +55,14 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Arrange for this cpu's next timer interrupt (and thus hardclock)
+ * to come HARDCLOCKS ticks from now, or as far off as the hardware
+ * allows if HARDCLOCKS is 0. Also acknowledges a pending timer
+ * interrupt.
+ */
+void mainbus_settimer(unsigned hardclocks);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -38,17 +38,37 @@
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
+#include <addrspace.h> /* for AS_MAXSTACKS */
 #include "opt-A2.h"
 #include "opt-A3.h"
 
-#define INITIAL_PROC_LIST_SIZE 32
-
 struct addrspace;
 struct vnode;
+struct lock;
+struct cv;
 #ifdef UW
 struct semaphore;
 #endif // UW
 
+/*
+ * User threads of a process, indexed by thread id. Thread 0 is the
+ * one the process started with (but a process forked by thread N
+ * starts out with just thread N); thread N runs on stack N of the
+ * address space. A slot stays UT_ZOMBIE from thread_exit until the
+ * thread is joined.
+ */
+#define PROC_MAXTHREADS AS_MAXSTACKS
+
+#define UT_FREE		0
+#define UT_RUNNING	1
+#define UT_ZOMBIE	2
+
+struct uthread {
+	unsigned ut_state;		/* UT_* */
+	bool ut_joining;		/* someone's waiting in thread_join */
+	userptr_t ut_retval;		/* from thread_exit */
+};
+
 /*
  * Process structure.
  */
@@ -63,6 +83,21 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
+	/* Resource usage; under p_lock */
+	struct threadusage p_usage;	/* of threads that have left */
+	struct threadusage p_childusage; /* of children that have exited */
+
+	/* Scheduling; under p_lock */
+	int p_nice;			/* setpriority value, PRIO_MIN..MAX */
+	uint32_t p_cpumask;		/* Cpus its threads may run on */
+
+	/* User threads */
+	struct lock *p_threadlock;	/* for p_uthreads */
+	struct cv *p_threadcv;		/* for thread_join */
+	struct uthread p_uthreads[PROC_MAXTHREADS];
+	unsigned p_nuthreads;		/* live user threads; under p_lock */
+	volatile bool p_exiting;	/* _exit was called; under p_lock */
+
 #ifdef UW
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
@@ -75,20 +110,20 @@ struct proc {
      bool loaded;
      #endif
 #if OPT_A2
-    struct cv *waitcv;
-    struct lock *waitlock;
     pid_t pid;
-    pid_t parent_pid;
-    int exitcode;
-    bool exited;
+    /* Parent and children; see the waitpid notes in proc.c */
+    struct proc *parent;        /* or NULL if nobody waits for it */
+    struct proc *children;      /* under waitlock */
+    struct proc *sibling;       /* next of parent's children */
+    struct lock *waitlock;
+    struct cv *waitcv;          /* for children's exits */
+    int exitcode;               /* from _exit */
+    bool exited;                /* a zombie; under parent's waitlock */
+    bool orphan;                /* parent exited; under parent's waitlock */
+    unsigned refcount;          /* under p_lock */
 #endif
 };
 
-#if OPT_A2
-extern struct proc **proc_list;
-
-#endif
-extern struct cv *fork_synch;
 /* This is the process structure for the kernel and for kernel-only threads. */
 extern struct proc *kproc;
 
@@ -101,11 +136,19 @@ extern struct semaphore *no_proc_sem;
 void proc_bootstrap(void);
 
 /* Create a fresh process for use by runprogram(). */
-struct proc *proc_create_runprogram(const char *name);
+int proc_create_runprogram(const char *name, struct proc **ret);
 
 #if OPT_A2
-/* Add a process to the proc_list */
-void proc_addtolist(struct proc *proc);
+/* Find a process by pid; call proc_lookupdone when done with it. */
+struct proc *proc_lookup(pid_t pid);
+void proc_lookupdone(void);
+
+/* Make a new process a child of another, or undo that if it never ran. */
+void proc_addchild(struct proc *parent, struct proc *child);
+void proc_remchild(struct proc *parent, struct proc *child);
+
+/* Collect an exited child of the current process (waitpid). */
+int proc_wait(pid_t pid, int options, int *status, pid_t *retpid);
 #endif
 
 /* Destroy a process. */
@@ -117,6 +160,24 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/* Detach a user thread from its process, unless it's the last one. */
+bool proc_remuthread(struct thread *t);
+
+/* Set a process's nice value, and its threads' strides to match. */
+void proc_setnice(struct proc *proc, int nice);
+
+/* Set the cpus a process's threads may run on. */
+void proc_setaffinity(struct proc *proc, uint32_t mask);
+
+/* Add one set of usage counters to another. */
+void threadusage_add(struct threadusage *to, const struct threadusage *from);
+
+/* Total resource usage of a process's threads, past and present. */
+void proc_getusage(struct proc *proc, struct threadusage *tu);
+
+/* Print resource usage of all processes (menu command). */
+void proc_printusage(void);
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
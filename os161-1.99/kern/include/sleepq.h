@@ -0,0 +1,32 @@
+#ifndef _SLEEPQ_H_
+#define _SLEEPQ_H_
+
+/*
+ * Sleep queues: wait channels shared by semaphores, locks and CVs.
+ *
+ * Instead of each having a wait channel of its own, these objects
+ * are hashed by address into a fixed table of channels, made once at
+ * boot. A thread waiting for an object sleeps on the object's channel
+ * with the object's address as its key (wchan_sleep_key), and wakeups
+ * are keyed the same way, so objects that share a channel only share
+ * its spinlock, never each other's sleepers. The channel's spinlock
+ * is also what protects the object's own state while waiting and
+ * waking.
+ *
+ * sleepq_get	Return OBJ's channel (not locked).
+ * sleepq_lock2	Lock two channels, which may be the same one, in a
+ *		fixed order. This is the only way to hold more than
+ *		one channel at a time.
+ * sleepq_unlock2  Undo sleepq_lock2.
+ */
+
+struct wchan;
+
+void sleepq_bootstrap(void);
+
+struct wchan *sleepq_get(const void *obj);
+void sleepq_lock2(struct wchan *a, struct wchan *b);
+void sleepq_unlock2(struct wchan *a, struct wchan *b);
+
+
+#endif /* _SLEEPQ_H_ */
@@ -36,6 +36,8 @@
  */
 
 #include <cdefs.h>
+#include <lockstat.h>
+#include <irqtrace.h>
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -45,6 +47,23 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/*
+ * Queue entry for a cpu holding or waiting for a spinlock (see
+ * spinlock.c). Each cpu has SPINLOCK_MAXHELD of these in its struct
+ * cpu, so it can hold (or wait for) that many spinlocks at once.
+ */
+struct spinlock_node {
+	struct spinlock_node *volatile sn_next;	/* Next cpu in line */
+	volatile bool sn_wait;		/* Set until the lock is passed to us */
+	bool sn_inuse;			/* Allocated to some spinlock */
+#if OPT_IRQTRACE
+	uint64_t sn_stamp;		/* When we got the lock, or 0 */
+	const void *sn_site;		/* Who got it */
+#endif
+};
+
+#define SPINLOCK_MAXHELD	8
+
 /*
  * Basic spinlock.
  *
@@ -55,14 +74,23 @@
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	struct spinlock_node *volatile lk_tail; /* Last cpu in line, or NULL */
+	struct spinlock_node *lk_node;	/* Holder's queue entry */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;	/* Stats for current acquisition */
+	uint64_t lk_stamp;		/* When it was acquired */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER	{ NULL, NULL, NULL, NULL, 0 }
+#else
+#define SPINLOCK_INITIALIZER	{ NULL, NULL, NULL }
+#endif
 
 /*
  * Spinlock functions.
@@ -71,6 +99,9 @@ struct spinlock {
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
+ *		Cpus get the lock in the order they asked for it.
+ * tryacquire	Get the lock if it is free right now; never spins. Returns
+ *		true (with interrupts disabled) on success, false otherwise.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
@@ -80,9 +111,13 @@ void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
+bool spinlock_tryacquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+/* Set up a cpu's queue entries. */
+void spinlock_nodes_init(struct spinlock_node *nodes);
+
 
 #endif /* _SPINLOCK_H_ */
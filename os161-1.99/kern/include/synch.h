@@ -32,35 +32,58 @@
 
 /*
  * Header file for synchronization primitives.
+ *
+ * Semaphores, locks and CVs have no wait channels of their own; they
+ * share the hashed sleep queues in sleepq.h, which are only touched
+ * when somebody actually has to wait. So they're small and need no
+ * allocation, and can be embedded in other structures, or defined
+ * statically with the _INITIALIZER macros, and set up with the _init
+ * functions. The _create functions allocate one and copy the name;
+ * the _init functions and initializers don't copy the name, so it
+ * has to stay around (normally it's a string constant).
  */
 
 
 #include <spinlock.h>
+#include <thread.h>
 
 /*
  * Dijkstra-style semaphore.
  *
- * The name field is for easier debugging. A copy of the name is made
- * internally.
+ * The name field is for easier debugging.
  */
 struct semaphore {
-        char *sem_name;
-	struct wchan *sem_wchan;
-	struct spinlock sem_lock;
-        volatile int sem_count;
+        const char *sem_name;
+        volatile unsigned sem_count;	/* changed with atomic_cas */
+	volatile unsigned sem_nwaiters;	/* sleepers; under sleep queue lock */
+#if OPT_LOCKSTAT
+	struct lockstat *sem_stat;
+#endif
 };
 
+#if OPT_LOCKSTAT
+#define SEMAPHORE_INITIALIZER(name, count)	{ name, count, 0, NULL }
+#else
+#define SEMAPHORE_INITIALIZER(name, count)	{ name, count, 0 }
+#endif
+
 struct semaphore *sem_create(const char *name, int initial_count);
 void sem_destroy(struct semaphore *);
+void sem_init(struct semaphore *, const char *name, int initial_count);
+void sem_cleanup(struct semaphore *);
 
 /*
  * Operations (both atomic):
  *     P (proberen): decrement count. If the count is 0, block until
  *                   the count is 1 again before decrementing.
  *     V (verhogen): increment count.
+ *
+ * sem_timedwait is P that gives up after TICKS hardclocks, returning
+ * ETIMEDOUT without touching the count; it returns 0 on success.
  */
 void P(struct semaphore *);
 void V(struct semaphore *);
+int sem_timedwait(struct semaphore *, unsigned ticks);
 
 
 /*
@@ -69,35 +92,56 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging.
  */
 struct lock {
-        char *lk_name;
-    struct wchan *lock_wchan;
-    struct spinlock lock_lock;
-    volatile struct thread *thread_ptr;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+        const char *lk_name;
+    struct thread *volatile thread_ptr;	/* owner; set with atomic_casptr */
+    volatile unsigned lock_nwaiters;	/* sleepers; under sleep queue lock */
+    /* priority inheritance; see synch.c */
+    unsigned lock_pi_waiters[MLFQ_LEVELS]; /* waiters at each level */
+    struct thread *lock_pi_owner;	/* whose t_pi_locks we're on */
+    struct lock *lock_pi_next;		/* next on that list */
+#if OPT_LOCKSTAT
+    struct lockstat *lock_stat;
+    uint64_t lock_stamp;		/* when acquired, or 0 */
+#endif
 };
 
+#if OPT_LOCKSTAT
+#define LOCK_INITIALIZER(name)	{ name, NULL, 0, { 0 }, NULL, NULL, NULL, 0 }
+#else
+#define LOCK_INITIALIZER(name)	{ name, NULL, 0, { 0 }, NULL, NULL }
+#endif
+
 struct lock *lock_create(const char *name);
-void lock_acquire(struct lock *);
+void lock_destroy(struct lock *);
+void lock_init(struct lock *, const char *name);
+void lock_cleanup(struct lock *);
 
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
- *                   same time.
+ *                   same time. If the lock is free it's taken with a
+ *                   single atomic operation; if the holder is running
+ *                   on another cpu we spin for a while in the hope it
+ *                   lets go soon, and only then go to sleep.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
+ *
+ * A thread that has to sleep waiting for a lock lends its scheduling
+ * level to the holder (priority inheritance) until the holder lets
+ * go. This can be turned off with lock_pi_enabled, for comparison.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
  *
  * These operations must be atomic. You get to write them.
  */
+void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
-void lock_destroy(struct lock *);
+
+extern volatile bool lock_pi_enabled;
 
 
 /*
@@ -110,19 +154,26 @@ void lock_destroy(struct lock *);
  * These CVs are expected to support Mesa semantics, that is, no
  * guarantees are made about scheduling.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging.
  */
 
 struct cv {
-        char *cv_name;
-    struct wchan *cv_wchan;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+        const char *cv_name;
+#if OPT_LOCKSTAT
+    struct lockstat *cv_stat;
+#endif
 };
 
+#if OPT_LOCKSTAT
+#define CV_INITIALIZER(name)	{ name, NULL }
+#else
+#define CV_INITIALIZER(name)	{ name }
+#endif
+
 struct cv *cv_create(const char *name);
 void cv_destroy(struct cv *);
+void cv_init(struct cv *, const char *name);
+void cv_cleanup(struct cv *);
 
 /*
  * Operations:
@@ -130,6 +181,11 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_timedwait - Like cv_wait, but wake up after TICKS hardclocks even
+ *                   if not signalled. Returns ETIMEDOUT if the time ran
+ *                   out and 0 otherwise; either way the lock is held
+ *                   again, and as with cv_wait the caller should check
+ *                   its condition.
  *
  * For all three operations, the current thread must hold the lock passed 
  * in. Note that under normal circumstances the same lock should be used
@@ -138,8 +194,57 @@ void cv_destroy(struct cv *);
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * By default writers are preferred: once a writer is waiting, new
+ * readers wait too, so a steady stream of readers can't keep writers
+ * out forever. Setting reader bias lets readers in whenever no writer
+ * actually holds the lock, which gets more readers through at the
+ * risk of starving writers; use it only where writes are rare and
+ * not urgent.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct wchan *rw_readwchan;		/* waiting readers */
+	struct wchan *rw_writewchan;		/* waiting writers */
+	struct spinlock rw_lock;		/* protects the rest */
+	volatile unsigned rw_readers;		/* readers holding it */
+	struct thread *volatile rw_writer;	/* writer holding it */
+	volatile unsigned rw_waitreaders;	/* readers asleep */
+	volatile unsigned rw_waitwriters;	/* writers asleep */
+	bool rw_readerbias;
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading (shared).
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing (exclusive).
+ *    rwlock_release_write - Give up the write hold. Only the thread
+ *                           holding it may do this.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ *    rwlock_setreaderbias - Switch reader bias (see above) on or off.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+void rwlock_setreaderbias(struct rwlock *, bool readerbias);
+
+
 #endif /* _SYNCH_H_ */
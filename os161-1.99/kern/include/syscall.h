@@ -33,6 +33,7 @@
 #include "opt-A2.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct addrspace;
 
 /*
  * The system call dispatcher.
@@ -52,12 +53,40 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
 
 void child_entry(void* arg1, unsigned long arg2);
+
+/* Set up the futex wait queues. */
+void futex_bootstrap(void);
+
+/* Wake every thread in a futex wait in AS (for _exit). */
+void futex_wakeall(struct addrspace *as);
+
+/* Tear down the current process; for the last thread to leave it. */
+void proc_exit(void);
+
+/* Leave the current process, tearing it down if we're the last. */
+void uthread_leave(void);
+
+/* Finish off the current thread if its process is exiting. */
+void uthread_exitcheck(void);
+
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
  */
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t req, userptr_t rem);
+int sys_getrusage(int who, userptr_t usage);
+int sys_getpriority(int which, pid_t who, int *retval);
+int sys_setpriority(int which, pid_t who, int prio);
+int sys_getaffinity(pid_t who, userptr_t maskptr);
+int sys_setaffinity(pid_t who, uint32_t mask);
+int sys_futex_wait(userptr_t uaddr, int val);
+int sys_futex_wake(userptr_t uaddr, int n, int *retval);
+int sys___thread_create(struct trapframe *tf, userptr_t entry,
+			userptr_t arg1, userptr_t arg2, int *retval);
+int sys_thread_join(unsigned tid, userptr_t retval_ptr);
+void sys_thread_exit(userptr_t value);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -59,6 +59,14 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int rwbench(int, char **);
+int pitest(int, char **);
+int spinbench(int, char **);
+int sleepqtest(int, char **);
+int pingpong(int, char **);
+int callouttest(int, char **);
+int timedwaittest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -78,6 +86,7 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int vmalloctest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -56,6 +57,22 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/* Number of scheduler priority levels */
+#define MLFQ_LEVELS 4
+
+/*
+ * Resource usage counters. Each thread keeps its own (see
+ * thread_hardclock and thread_switch); processes add them up (see
+ * proc.h). Times are in hardclocks.
+ */
+struct threadusage {
+	uint64_t tu_utime;		/* Time in user mode */
+	uint64_t tu_stime;		/* Time in the kernel */
+	unsigned tu_nvcsw;		/* Voluntary context switches */
+	unsigned tu_nivcsw;		/* Involuntary context switches */
+	unsigned tu_minflt;		/* Page faults */
+};
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -79,10 +96,35 @@ struct thread {
 	 */
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
+	const void *t_sleepkey;		/* Object slept for, on a shared wchan */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_tid;			/* User thread id within t_proc */
+
+	/*
+	 * Scheduler fields. See the scheduler notes in thread.c.
+	 */
+	unsigned t_mlfq_level;		/* Priority level, 0 is highest */
+	unsigned t_mlfq_ticks;		/* Hardclocks used at this level */
+	unsigned t_pi_level;		/* Level lent by lock waiters */
+	unsigned t_stride;		/* Share within a level; see thread_stride */
+	uint64_t t_pass;		/* Strides used so far */
+	uint32_t t_cpumask;		/* Cpus we may run on */
+	struct thread *t_handoff;	/* Thread we last woke (a hint) */
+	struct cpu *t_handoffcpu;	/* ...and the cpu it was put on */
+
+	/*
+	 * Priority inheritance bookkeeping. Protected by the priority
+	 * inheritance spinlock in synch.c.
+	 */
+	struct lock *t_pi_blockedon;	/* Lock we're waiting for */
+	unsigned t_pi_waitlevel;	/* Level we're counted at there */
+	struct lock *t_pi_locks;	/* Locks we hold that have waiters */
+
+	/* Resource usage; only changed by the thread itself */
+	struct threadusage t_usage;
 
 	/*
 	 * Interrupt state fields.
@@ -91,6 +133,7 @@ struct thread {
 	 * interrupt handler, which means the thread's normal context
 	 * of execution is stopped somewhere in the middle of doing
 	 * something else. This makes assorted operations unsafe.
+	 * t_intr_user says whether that was user code, for accounting.
 	 *
 	 * See notes in spinlock.c regarding t_curspl and t_iplhigh_count.
 	 *
@@ -98,6 +141,7 @@ struct thread {
 	 * rather than per-cpu or global?
 	 */
 	bool t_in_interrupt;		/* Are we in an interrupt? */
+	bool t_intr_user;		/* Did it interrupt user mode? */
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
@@ -118,6 +162,14 @@ struct thread {
 DECLARRAY(thread);
 DEFARRAY(thread, THREADINLINE);
 
+/*
+ * Number of exited threads (with their stacks) each cpu keeps around
+ * for thread_fork to reuse. May be changed at any time; a smaller
+ * value takes effect as pooled threads are used up.
+ */
+#define THREAD_POOL_DEFAULT 8
+extern unsigned thread_pool_max;
+
 /* Call once during system startup to allocate data structures. */
 void thread_bootstrap(void);
 
@@ -157,16 +209,56 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * If true (the default), a thread that wakes another and then goes
+ * to sleep itself hands its cpu straight to the one it woke. See
+ * thread_handoff in thread.c.
+ */
+extern volatile bool thread_handoff_enabled;
+
+/*
+ * Charge the current thread for TICKS clock ticks. Returns true if it
+ * should yield. Called from the timer interrupt.
+ */
+bool thread_hardclock(unsigned ticks);
+
+/*
+ * True if some other cpu has threads waiting on its run queue that
+ * an idle cpu might steal. Only a hint; see thread_steal.
+ */
+bool thread_work_elsewhere(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Scheduling level a thread runs at: its own MLFQ level or the level
+ * it has inherited from threads waiting on its locks, whichever is
+ * better (lower). thread_set_pi_level changes the inherited part,
+ * moving the thread within its run queue if necessary; MLFQ_LEVELS
+ * means nothing is inherited.
+ */
+unsigned thread_level(const struct thread *t);
+void thread_set_pi_level(struct thread *t, unsigned level);
+
+/*
+ * Stride for threads of a process with nice value NICE (PRIO_MIN to
+ * PRIO_MAX, 0 normally). Threads at the same level get the cpu in
+ * inverse proportion to their strides. proc_addthread and
+ * proc_setnice keep t_stride in line with the process's nice value.
+ */
+unsigned thread_stride(int nice);
+
+/*
+ * Cpu affinity: bit N of t_cpumask allows cpu N (c_number). Like the
+ * stride, it's set for a whole process (proc_setaffinity) and copied
+ * into threads as they join it. thread_cpumask_online returns the
+ * bits for the cpus that exist.
  */
-void thread_consider_migration(void);
+#define CPUMASK_ALL	0xffffffff
+uint32_t thread_cpumask_online(void);
 
 
 #endif /* _THREAD_H_ */
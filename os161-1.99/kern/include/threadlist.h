@@ -38,9 +38,8 @@ struct thread;	/* from <thread.h> */
  *
  * The two threadlistnodes in the threadlist structure are always on
  * the list, as bookends; this removes all the special cases in the
- * list handling code. However, note how THREADLIST_FOREACH works: you
- * iterate by starting with tl_head.tln_next, and stop when
- * itervar->tln_next is null, not when itervar itself becomes null.
+ * list handling code. The bookends' ->tln_self is null, which is how
+ * THREADLIST_FORALL knows it has run off the end of the list.
  *
  * ->tln_self always points to the thread that contains the
  * threadlistnode. We could avoid this if we wanted to instead use
@@ -89,12 +88,12 @@ void threadlist_remove(struct threadlist *tl, struct thread *t);
 /* Iteration; itervar should previously be declared as (struct thread *) */
 #define THREADLIST_FORALL(itervar, tl) \
 	for ((itervar) = (tl).tl_head.tln_next->tln_self; \
-	     (itervar)->t_listnode.tln_next != NULL; \
+	     (itervar) != NULL; \
 	     (itervar) = (itervar)->t_listnode.tln_next->tln_self)
 
 #define THREADLIST_FORALL_REV(itervar, tl) \
 	for ((itervar) = (tl).tl_tail.tln_prev->tln_self; \
-	     (itervar)->t_listnode.tln_prev != NULL; \
+	     (itervar) != NULL; \
 	     (itervar) = (itervar)->t_listnode.tln_prev->tln_self)
 
 
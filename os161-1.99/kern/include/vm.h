@@ -58,6 +58,16 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Allocate/free virtually (but not physically) contiguous kernel
+ * memory. Good for big tables and buffers; not for kernel stacks,
+ * which the exception code must be able to touch without taking a
+ * TLB miss. kmalloc uses this when alloc_kpages can't find a run.
+ */
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+void vmalloc_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
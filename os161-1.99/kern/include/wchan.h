@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct thread; /* from <thread.h> */
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -81,5 +82,26 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up thread T if it is sleeping on the wait channel. Returns
+ * true if it was. This is for timeouts, which need to pull a
+ * particular thread off a channel.
+ */
+bool wchan_wakethread(struct wchan *wc, struct thread *t);
+
+/*
+ * Sleeping and waking by key, for a channel shared among several
+ * objects: wchan_sleep_key is wchan_sleep, noting KEY (normally the
+ * address of the object waited for), and the wakeups only pick
+ * threads that slept with the same KEY. wchan_wakeone_key returns
+ * true if it found one.
+ *
+ * Unlike the plain wakeups, these must be called with the channel
+ * locked, and leave it locked.
+ */
+void wchan_sleep_key(struct wchan *wc, const void *key);
+bool wchan_wakeone_key(struct wchan *wc, const void *key);
+void wchan_wakeall_key(struct wchan *wc, const void *key);
+
 
 #endif /* _WCHAN_H_ */
@@ -52,7 +52,13 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <clock.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>  
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <kern/wait.h>
+#include <limits.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -65,19 +71,217 @@ struct proc *kproc;
 #ifdef UW
 /* count of the number of processes, excluding kproc */
 static unsigned int proc_count;
-/* provides mutual exclusion for proc_count */
-/* it would be better to use a lock here, but we use a semaphore because locks are not implemented in the base kernel */ 
-static struct semaphore *proc_count_mutex;
+/* provides mutual exclusion for proc_count; only ever held briefly */
+static struct spinlock proc_count_lock = SPINLOCK_INITIALIZER;
 /* used to signal the kernel menu thread when there are no processes */
 struct semaphore *no_proc_sem;
 #endif  // UW
 
 #if OPT_A2
-struct semaphore *proc_list_mutex;
-struct proc **proc_list;
-struct cv *fork_synch;
+/*
+ * The pid table. Slot i holds the process, if any, whose pid is i
+ * modulo pid_nslots, which is a power of two. Each time a slot is
+ * reused its pid goes up by pid_nslots, wrapping around at PID_MAX,
+ * so a pid doesn't come back until the slot has gone once round the
+ * whole pid space; someone holding on to an old pid finds nothing,
+ * rather than some new process that happens to have it. This is the
+ * generation counter: pid = generation * pid_nslots + slot.
+ *
+ * Free slots are kept on a list, oldest freed first, so allocating
+ * and freeing are O(1). When the list runs dry the table doubles,
+ * up to PIDTABLE_MAXSLOTS; each live process moves to the one of its
+ * old slot's two successors that its pid now maps to.
+ *
+ * pid_rwlock protects all of it. Lookups only need it for reading,
+ * and so go on in parallel; allocating, freeing and growing take it
+ * for writing, but don't do anything slow with it held. A pid is
+ * freed before its process is, so the process found by proc_lookup
+ * stays put until proc_lookupdone.
+ *
+ * kproc isn't in the table; it's pid 1, which no slot ever hands out.
+ */
+#define PIDTABLE_INITSLOTS	32
+#define PIDTABLE_MAXSLOTS	((PID_MAX + 1) / 2)
+
+struct pidslot {
+	struct proc *ps_proc;		/* Process, or NULL if free */
+	pid_t ps_pid;			/* Its pid, or the last one given out */
+	int ps_nextfree;		/* Free list link, or -1 */
+};
+
+static struct rwlock *pid_rwlock;
+static struct pidslot *pid_slots;
+static unsigned pid_nslots;
+static int pid_freehead;		/* Free list; -1 if empty */
+static int pid_freetail;
 #endif
 
+#if OPT_A2
+/*
+ * The pid slot SLOT hands out after LAST: the next one up that maps
+ * to it, or after wrapping, the lowest one at or above PID_MIN.
+ */
+static
+pid_t
+pid_next(pid_t last, unsigned slot)
+{
+	pid_t pid;
+
+	pid = last + (pid_t)pid_nslots;
+	if (pid > PID_MAX) {
+		pid = slot;
+	}
+	while (pid < PID_MIN) {
+		pid += pid_nslots;
+	}
+	return pid;
+}
+
+/*
+ * Put a slot on the end of the free list.
+ */
+static
+void
+pid_pushfree(int slot)
+{
+	pid_slots[slot].ps_nextfree = -1;
+	if (pid_freetail < 0) {
+		pid_freehead = slot;
+	}
+	else {
+		pid_slots[pid_freetail].ps_nextfree = slot;
+	}
+	pid_freetail = slot;
+}
+
+/*
+ * Double the pid table. pid_rwlock held for writing.
+ *
+ * Old slot i becomes new slots i and i + oldn. Whichever its pid (or
+ * last pid, if free) maps to keeps it; the other gets a last pid one
+ * step back in its own sequence, so neither hands out anything at or
+ * below the old slot's last pid before wrapping.
+ */
+static
+int
+pid_grow(void)
+{
+	struct pidslot *slots;
+	unsigned i, oldn, newn, mine, other;
+
+	oldn = pid_nslots;
+	if (oldn >= PIDTABLE_MAXSLOTS) {
+		return ENPROC;
+	}
+	newn = oldn * 2;
+	slots = kmalloc(newn * sizeof(*slots));
+	if (slots == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<oldn; i++) {
+		mine = (unsigned)pid_slots[i].ps_pid & (newn - 1);
+		other = mine ^ oldn;
+		slots[mine].ps_proc = pid_slots[i].ps_proc;
+		slots[mine].ps_pid = pid_slots[i].ps_pid;
+		slots[other].ps_proc = NULL;
+		slots[other].ps_pid = pid_slots[i].ps_pid - (pid_t)oldn;
+	}
+	kfree(pid_slots);
+	pid_slots = slots;
+	pid_nslots = newn;
+
+	pid_freehead = pid_freetail = -1;
+	for (i=0; i<newn; i++) {
+		if (slots[i].ps_proc == NULL) {
+			pid_pushfree(i);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Give PROC a pid, growing the table if it's full.
+ */
+static
+int
+pid_alloc(struct proc *proc)
+{
+	struct pidslot *ps;
+	int slot, result;
+
+	rwlock_acquire_write(pid_rwlock);
+	if (pid_freehead < 0) {
+		result = pid_grow();
+		if (result) {
+			rwlock_release_write(pid_rwlock);
+			return result;
+		}
+	}
+	slot = pid_freehead;
+	ps = &pid_slots[slot];
+	pid_freehead = ps->ps_nextfree;
+	if (pid_freehead < 0) {
+		pid_freetail = -1;
+	}
+	ps->ps_proc = proc;
+	ps->ps_pid = pid_next(ps->ps_pid, slot);
+	proc->pid = ps->ps_pid;
+	rwlock_release_write(pid_rwlock);
+	return 0;
+}
+
+/*
+ * Give back a pid. The slot remembers it, so the next process to use
+ * the slot gets a different one.
+ */
+static
+void
+pid_free(pid_t pid)
+{
+	unsigned slot;
+
+	rwlock_acquire_write(pid_rwlock);
+	slot = (unsigned)pid & (pid_nslots - 1);
+	KASSERT(pid_slots[slot].ps_proc != NULL);
+	KASSERT(pid_slots[slot].ps_pid == pid);
+	pid_slots[slot].ps_proc = NULL;
+	pid_pushfree(slot);
+	rwlock_release_write(pid_rwlock);
+}
+
+/*
+ * Find the process with pid PID (kproc for 1), or NULL if there's
+ * none. Either way, call proc_lookupdone when finished with the
+ * result; until then it may exit, but won't be destroyed. Don't look
+ * up another process in between.
+ */
+struct proc *
+proc_lookup(pid_t pid)
+{
+	struct pidslot *ps;
+
+	rwlock_acquire_read(pid_rwlock);
+	if (pid == kproc->pid) {
+		return kproc;
+	}
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
+	}
+	ps = &pid_slots[(unsigned)pid & (pid_nslots - 1)];
+	if (ps->ps_proc == NULL || ps->ps_pid != pid) {
+		return NULL;
+	}
+	return ps->ps_proc;
+}
+
+void
+proc_lookupdone(void)
+{
+	rwlock_release_read(pid_rwlock);
+}
+#endif /* OPT_A2 */
+
 /*
  * Create a proc structure.
  */
@@ -106,19 +310,207 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
+	/* Accounting */
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_childusage, sizeof(proc->p_childusage));
+
+	/* Scheduling */
+	proc->p_nice = 0;
+	proc->p_cpumask = CPUMASK_ALL;
+
+	/* User threads; see proc_create_runprogram */
+	proc->p_threadlock = NULL;
+	proc->p_threadcv = NULL;
+	bzero(proc->p_uthreads, sizeof(proc->p_uthreads));
+	proc->p_nuthreads = 0;
+	proc->p_exiting = false;
+
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
 
+#if OPT_A2
+	proc->pid = 0;
+	proc->parent = NULL;
+	proc->children = NULL;
+	proc->sibling = NULL;
+	proc->waitlock = NULL;
+	proc->waitcv = NULL;
+	proc->exitcode = 0;
+	proc->exited = false;
+	proc->orphan = false;
+	proc->refcount = 1;
+#endif
+
 	return proc;
 }
 
+/*
+ * Free a proc structure that proc_create_runprogram didn't finish
+ * setting up.
+ */
+static
+void
+proc_unmake(struct proc *proc)
+{
+	if (proc->p_threadlock != NULL) {
+		lock_destroy(proc->p_threadlock);
+	}
+	if (proc->p_threadcv != NULL) {
+		cv_destroy(proc->p_threadcv);
+	}
+#if OPT_A2
+	if (proc->waitlock != NULL) {
+		lock_destroy(proc->waitlock);
+	}
+	if (proc->waitcv != NULL) {
+		cv_destroy(proc->waitcv);
+	}
+#endif
+	spinlock_cleanup(&proc->p_lock);
+	threadarray_cleanup(&proc->p_threads);
+	kfree(proc->p_name);
+	kfree(proc);
+}
+
+#if OPT_A2
+/*
+ * Parents, children and waitpid.
+ *
+ * Each process keeps a list of its children, linked through sibling,
+ * and its own waitlock and waitcv. Everything to do with a child's
+ * exit is under its parent's waitlock: the children list, and the
+ * child's exited, orphan and exitcode as seen by the parent. A child
+ * that exits takes its parent's waitlock, marks itself exited, and
+ * wakes its parent on waitcv; waitpid sleeps there, and so only
+ * wakes for its own children. There's no lock for the whole system.
+ *
+ * The struct proc of a process that has exited is a zombie, kept
+ * for its parent to collect the exit code from. When a parent exits
+ * first, it frees its zombie children and marks the others orphans,
+ * which free themselves when they exit.
+ *
+ * The struct is reference counted (refcount, under p_lock), since it
+ * can be pointed to from two sides: one reference for its place on
+ * its parent's list (or for itself, if it has no parent), and one
+ * from each child's parent pointer, which the child drops once it
+ * has finished exiting. So a child can always get at its parent's
+ * waitlock, even if the parent has been collected in the meantime.
+ * A process's pid goes with the struct.
+ */
+
+/*
+ * Drop a reference to a process structure; free it if that was the
+ * last one. By then everything else was torn down by proc_destroy.
+ */
+static
+void
+proc_release(struct proc *proc)
+{
+	bool last;
+
+	spinlock_acquire(&proc->p_lock);
+	KASSERT(proc->refcount > 0);
+	proc->refcount--;
+	last = proc->refcount == 0;
+	spinlock_release(&proc->p_lock);
+	if (!last) {
+		return;
+	}
+
+	KASSERT(proc->children == NULL);
+	/* pid first, so lookups can't find it once it's gone */
+	pid_free(proc->pid);
+	cv_destroy(proc->waitcv);
+	lock_destroy(proc->waitlock);
+	spinlock_cleanup(&proc->p_lock);
+	kfree(proc->p_name);
+	kfree(proc);
+}
+
+/*
+ * On exit, let go of PROC's children: free the ones that have exited
+ * and leave the rest to free themselves.
+ */
+static
+void
+proc_orphanchildren(struct proc *proc)
+{
+	struct proc *child, *zombies;
+
+	zombies = NULL;
+	lock_acquire(proc->waitlock);
+	while (proc->children != NULL) {
+		child = proc->children;
+		proc->children = child->sibling;
+		if (child->exited) {
+			child->sibling = zombies;
+			zombies = child;
+		}
+		else {
+			child->sibling = NULL;
+			child->orphan = true;
+		}
+	}
+	lock_release(proc->waitlock);
+
+	while (zombies != NULL) {
+		child = zombies;
+		zombies = child->sibling;
+		proc_release(child);
+	}
+}
+
+/*
+ * On exit, tell PROC's parent, if it has one that's still waiting,
+ * and hand its resource usage on. Usage of processes without one
+ * goes to kproc, which is everyone's parent as far as the menu's
+ * reports are concerned. After this PROC may be gone.
+ */
+static
+void
+proc_notifyparent(struct proc *proc)
+{
+	struct proc *parent, *to;
+	bool orphan;
+
+	parent = proc->parent;
+	if (parent != NULL) {
+		lock_acquire(parent->waitlock);
+	}
+	orphan = parent == NULL || proc->orphan;
+	to = orphan ? kproc : parent;
+	spinlock_acquire(&to->p_lock);
+	threadusage_add(&to->p_childusage, &proc->p_usage);
+	threadusage_add(&to->p_childusage, &proc->p_childusage);
+	spinlock_release(&to->p_lock);
+	proc->exited = true;
+	if (parent != NULL) {
+		if (!orphan) {
+			cv_broadcast(parent->waitcv, parent->waitlock);
+		}
+		lock_release(parent->waitlock);
+	}
+
+	if (orphan) {
+		proc_release(proc);
+	}
+	if (parent != NULL) {
+		proc_release(parent);
+	}
+}
+#endif /* OPT_A2 */
+
 /*
  * Destroy a proc structure.
  */
 void
 proc_destroy(struct proc *proc)
 {
+#ifdef UW
+	bool last;
+#endif
+
 	/*
          * note: some parts of the process structure, such as the address space,
          *  are destroyed in sys_exit, before we get here
@@ -134,7 +526,9 @@ proc_destroy(struct proc *proc)
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
-	 * incorrect to destroy it.)
+	 * incorrect to destroy it.) With OPT_A2 the structure itself
+	 * may stay around for its parent to look at, but nobody
+	 * touches what's torn down here.
 	 */
 
 	/* VFS fields */
@@ -170,26 +564,18 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
+	if (proc->p_threadcv != NULL) {
+		cv_destroy(proc->p_threadcv);
+	}
+	if (proc->p_threadlock != NULL) {
+		lock_destroy(proc->p_threadlock);
+	}
+
 	threadarray_cleanup(&proc->p_threads);
+#if !OPT_A2
+	/* with OPT_A2 this waits until the struct goes; see proc_release */
 	spinlock_cleanup(&proc->p_lock);
-	
-#if OPT_A2
-    P(proc_list_mutex);
-    if(proc->parent_pid == 1 || proc_list[proc->parent_pid]->exited){
-        proc_list[proc->pid] = NULL;
-        kfree(proc->p_name);
-        cv_destroy(proc->waitcv);
-        kfree(proc);
-    } else {
-        proc->exited = true;
-        //cv_broadcast(proc->waitcv, NULL);
-    }
-    V(proc_list_mutex);
-#else
-    kfree(proc->p_name);
-	kfree(proc);
 #endif
-    
 
 
 #ifdef UW
@@ -197,16 +583,25 @@ proc_destroy(struct proc *proc)
         /* note: kproc is not included in the process count, but proc_destroy
 	   is never called on kproc (see KASSERT above), so we're OK to decrement
 	   the proc_count unconditionally here */
-	P(proc_count_mutex); 
+	spinlock_acquire(&proc_count_lock);
 	KASSERT(proc_count > 0);
 	proc_count--;
+	last = proc_count == 0;
+	spinlock_release(&proc_count_lock);
 	/* signal the kernel menu thread if the process count has reached zero */
-	if (proc_count == 0) {
+	if (last) {
 	  V(no_proc_sem);
 	}
-	V(proc_count_mutex);
 #endif // UW
 
+#if OPT_A2
+	/* Last: once the parent knows, it may free the struct at any time. */
+	proc_orphanchildren(proc);
+	proc_notifyparent(proc);
+#else
+	kfree(proc->p_name);
+	kfree(proc);
+#endif
 
 }
 
@@ -216,27 +611,36 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+#if OPT_A2
+  unsigned i;
+#endif
+
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
   }
 #ifdef UW
   proc_count = 0;
-  proc_count_mutex = sem_create("proc_count_mutex",1);
-  if (proc_count_mutex == NULL) {
-    panic("could not create proc_count_mutex semaphore\n");
-  }
   no_proc_sem = sem_create("no_proc_sem",0);
   if (no_proc_sem == NULL) {
     panic("could not create no_proc_sem semaphore\n");
   }
 #endif // UW
 #if OPT_A2
-    proc_list = kmalloc(INITIAL_PROC_LIST_SIZE*sizeof(struct proc *));
-    proc_list[1] = kproc;
     kproc->pid = 1;
-    proc_list_mutex = sem_create("proc_list_mutex",1);
-    fork_synch = cv_create("fork synch");
+    pid_rwlock = rwlock_create("pid table");
+    pid_slots = kmalloc(PIDTABLE_INITSLOTS * sizeof(*pid_slots));
+    if (pid_rwlock == NULL || pid_slots == NULL) {
+        panic("could not create the pid table\n");
+    }
+    pid_nslots = PIDTABLE_INITSLOTS;
+    pid_freehead = pid_freetail = -1;
+    for (i = 0; i < pid_nslots; i++) {
+        /* so the first pid out of slot i is i (or i + PIDTABLE_INITSLOTS) */
+        pid_slots[i].ps_proc = NULL;
+        pid_slots[i].ps_pid = (pid_t)i - PIDTABLE_INITSLOTS;
+        pid_pushfree(i);
+    }
 #endif
 #if opt-A3
     proc->loaded = false;
@@ -248,18 +652,50 @@ proc_bootstrap(void)
  *
  * It will have no address space and will inherit the current
  * process's (that is, the kernel menu's) current directory.
+ *
+ * Returns ENOMEM if it can't be allocated, and ENPROC if there are no
+ * pids left.
  */
-struct proc *
-proc_create_runprogram(const char *name)
+int
+proc_create_runprogram(const char *name, struct proc **ret)
 {
 	struct proc *proc;
 	char *console_path;
+#if OPT_A2
+	int result;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
-		return NULL;
+		return ENOMEM;
 	}
 
+	/* The thread that's about to be started in it is thread 0. */
+	proc->p_threadlock = lock_create("uthreads");
+	proc->p_threadcv = cv_create("uthreads");
+	if (proc->p_threadlock == NULL || proc->p_threadcv == NULL) {
+		proc_unmake(proc);
+		return ENOMEM;
+	}
+	proc->p_uthreads[0].ut_state = UT_RUNNING;
+	proc->p_nuthreads = 1;
+
+#if OPT_A2
+    /* nobody waits for it unless fork makes it a child (proc_addchild) */
+    proc->waitcv = cv_create("wait cv");
+    proc->waitlock = lock_create("wait lock");
+    /* last: once it has a pid, others can look it up */
+    if (proc->waitcv == NULL || proc->waitlock == NULL) {
+        proc_unmake(proc);
+        return ENOMEM;
+    }
+    result = pid_alloc(proc);
+    if (result) {
+        proc_unmake(proc);
+        return result;
+    }
+#endif
+
 #ifdef UW
 	/* open the console - this should always succeed */
 	console_path = kstrdup("con:");
@@ -299,42 +735,122 @@ proc_create_runprogram(const char *name)
 	/* increment the count of processes */
         /* we are assuming that all procs, including those created by fork(),
            are created using a call to proc_create_runprogram  */
-	P(proc_count_mutex); 
+	spinlock_acquire(&proc_count_lock);
 	proc_count++;
-	V(proc_count_mutex);
+	spinlock_release(&proc_count_lock);
 #endif // UW
 
-#if OPT_A2
-    proc->parent_pid = 1;   // every proc is by default the kernel's child
-    proc->exitcode = -1;
-    proc->exited = false;
-    proc->waitcv = cv_create("wait cv");
-    proc->waitlock = lock_create("wait lock");
-    P(proc_list_mutex);
-    proc_addtolist(proc);
-    V(proc_list_mutex);
-#endif
-
 #if opt-A3
     proc->loaded = false;
 #endif
     
-	return proc;
+	*ret = proc;
+	return 0;
 }
 
 #if OPT_A2
+/*
+ * Make CHILD, which fork has just created and not yet started, a
+ * child of PARENT.
+ */
 void
-proc_addtolist(struct proc* proc) {
-    for(int i = 2; i < INITIAL_PROC_LIST_SIZE; i++) {
-        if(proc_list[i] == NULL) {
-            proc_list[i] = proc;
-            proc->pid = i;
-            return;
-        }
-    }
-    panic("Number of processes exceeded %d\n", INITIAL_PROC_LIST_SIZE);
+proc_addchild(struct proc *parent, struct proc *child)
+{
+	KASSERT(child->parent == NULL);
+
+	spinlock_acquire(&parent->p_lock);
+	parent->refcount++;
+	spinlock_release(&parent->p_lock);
+	child->parent = parent;
+
+	lock_acquire(parent->waitlock);
+	child->sibling = parent->children;
+	parent->children = child;
+	lock_release(parent->waitlock);
 }
-#endif
+
+/*
+ * Undo proc_addchild, for a child that fork then failed to start.
+ */
+void
+proc_remchild(struct proc *parent, struct proc *child)
+{
+	struct proc **pp;
+
+	KASSERT(child->parent == parent);
+
+	lock_acquire(parent->waitlock);
+	for (pp = &parent->children; *pp != child; pp = &(*pp)->sibling) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = child->sibling;
+	lock_release(parent->waitlock);
+	child->sibling = NULL;
+	child->parent = NULL;
+	proc_release(parent);
+}
+
+/*
+ * Wait for the current process's child PID, or any child if PID is
+ * WAIT_ANY, to exit, and collect it. Returns its pid and encoded exit
+ * status; or with WNOHANG, pid 0 if none has exited yet.
+ */
+int
+proc_wait(pid_t pid, int options, int *status, pid_t *retpid)
+{
+	struct proc *proc = curproc;
+	struct proc *child, **pp;
+	bool found;
+
+	if ((options & ~WNOHANG) != 0) {
+		return EINVAL;
+	}
+	if (pid <= 0 && pid != WAIT_ANY) {
+		/* no process groups */
+		return EINVAL;
+	}
+
+	lock_acquire(proc->waitlock);
+	while (1) {
+		found = false;
+		for (pp = &proc->children; *pp != NULL; pp = &(*pp)->sibling) {
+			if (pid == WAIT_ANY || (*pp)->pid == pid) {
+				found = true;
+				if ((*pp)->exited) {
+					break;
+				}
+			}
+		}
+		if (*pp != NULL) {
+			break;
+		}
+		if (!found) {
+			lock_release(proc->waitlock);
+			if (pid == WAIT_ANY) {
+				return ECHILD;
+			}
+			child = proc_lookup(pid);
+			proc_lookupdone();
+			return child != NULL ? ECHILD : ESRCH;
+		}
+		if (options & WNOHANG) {
+			lock_release(proc->waitlock);
+			*retpid = 0;
+			return 0;
+		}
+		cv_wait(proc->waitcv, proc->waitlock);
+	}
+	child = *pp;
+	*pp = child->sibling;
+	lock_release(proc->waitlock);
+
+	/* Off the list, it's ours; it won't change any more. */
+	*status = _MKWAIT_EXIT(child->exitcode);
+	*retpid = child->pid;
+	proc_release(child);
+	return 0;
+}
+#endif /* OPT_A2 */
 
 /*
  * Add a thread to a process. Either the thread or the process might
@@ -349,6 +865,10 @@ proc_addthread(struct proc *proc, struct thread *t)
 
 	spinlock_acquire(&proc->p_lock);
 	result = threadarray_add(&proc->p_threads, t, NULL);
+	if (result == 0) {
+		t->t_stride = thread_stride(proc->p_nice);
+		t->t_cpumask = proc->p_cpumask;
+	}
 	spinlock_release(&proc->p_lock);
 	if (result) {
 		return result;
@@ -357,6 +877,28 @@ proc_addthread(struct proc *proc, struct thread *t)
 	return 0;
 }
 
+/*
+ * Take a thread out of its process's thread array. Process locked.
+ */
+static
+void
+proc_detach(struct proc *proc, struct thread *t)
+{
+	unsigned i, num;
+
+	/* ugh: find the thread in the array */
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		if (threadarray_get(&proc->p_threads, i) == t) {
+			threadarray_remove(&proc->p_threads, i);
+			threadusage_add(&proc->p_usage, &t->t_usage);
+			return;
+		}
+	}
+	/* Did not find it. */
+	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
+}
+
 /*
  * Remove a thread from its process. Either the thread or the process
  * might or might not be current.
@@ -365,25 +907,162 @@ void
 proc_remthread(struct thread *t)
 {
 	struct proc *proc;
-	unsigned i, num;
 
 	proc = t->t_proc;
 	KASSERT(proc != NULL);
 
 	spinlock_acquire(&proc->p_lock);
-	/* ugh: find the thread in the array */
+	proc_detach(proc, t);
+	spinlock_release(&proc->p_lock);
+	t->t_proc = NULL;
+}
+
+/*
+ * Remove a user thread from its process, unless it's the last one;
+ * then leave it be and return false, so it can tear the process down.
+ * Done in one go so the last thread can't go ahead and destroy the
+ * process while the others are still on their way out of it.
+ */
+bool
+proc_remuthread(struct thread *t)
+{
+	struct proc *proc;
+
+	proc = t->t_proc;
+	KASSERT(proc != NULL);
+
+	spinlock_acquire(&proc->p_lock);
+	KASSERT(proc->p_nuthreads > 0);
+	if (proc->p_nuthreads == 1) {
+		spinlock_release(&proc->p_lock);
+		return false;
+	}
+	proc->p_nuthreads--;
+	proc_detach(proc, t);
+	spinlock_release(&proc->p_lock);
+	t->t_proc = NULL;
+	return true;
+}
+
+/*
+ * Change a process's nice value. The scheduler reads t_stride a word
+ * at a time without locking, so it's fine to change it under a thread
+ * that's running or queued; the new share applies from then on.
+ */
+void
+proc_setnice(struct proc *proc, int nice)
+{
+	unsigned i, num, stride;
+
+	KASSERT(nice >= PRIO_MIN && nice <= PRIO_MAX);
+	stride = thread_stride(nice);
+
+	spinlock_acquire(&proc->p_lock);
+	proc->p_nice = nice;
 	num = threadarray_num(&proc->p_threads);
 	for (i=0; i<num; i++) {
-		if (threadarray_get(&proc->p_threads, i) == t) {
-			threadarray_remove(&proc->p_threads, i);
-			spinlock_release(&proc->p_lock);
-			t->t_proc = NULL;
-			return;
-		}
+		threadarray_get(&proc->p_threads, i)->t_stride = stride;
 	}
-	/* Did not find it. */
 	spinlock_release(&proc->p_lock);
-	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
+}
+
+/*
+ * Change the cpus a process's threads may run on. Like t_stride,
+ * t_cpumask is read without locking. Threads now on a cpu they're
+ * not allowed on move at their next context switch (see the affinity
+ * notes in thread.c).
+ */
+void
+proc_setaffinity(struct proc *proc, uint32_t mask)
+{
+	unsigned i, num;
+
+	KASSERT((mask & thread_cpumask_online()) != 0);
+
+	spinlock_acquire(&proc->p_lock);
+	proc->p_cpumask = mask;
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		threadarray_get(&proc->p_threads, i)->t_cpumask = mask;
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+void
+threadusage_add(struct threadusage *to, const struct threadusage *from)
+{
+	to->tu_utime += from->tu_utime;
+	to->tu_stime += from->tu_stime;
+	to->tu_nvcsw += from->tu_nvcsw;
+	to->tu_nivcsw += from->tu_nivcsw;
+	to->tu_minflt += from->tu_minflt;
+}
+
+/*
+ * Add up the usage of the threads that have left PROC and of those
+ * still in it. The latter are still running, so their counters may
+ * be a tick or two out of date by the time anyone looks.
+ */
+void
+proc_getusage(struct proc *proc, struct threadusage *tu)
+{
+	struct thread *t;
+	unsigned i, num;
+
+	spinlock_acquire(&proc->p_lock);
+	*tu = proc->p_usage;
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		threadusage_add(tu, &t->t_usage);
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+static
+void
+proc_printoneusage(int pid, struct proc *proc)
+{
+	struct threadusage tu, cu;
+
+	proc_getusage(proc, &tu);
+	spinlock_acquire(&proc->p_lock);
+	cu = proc->p_childusage;
+	spinlock_release(&proc->p_lock);
+
+	kprintf("%5d %-16s %8llu %8llu %7u %7u %7u %8llu %8llu\n",
+		pid, proc->p_name,
+		tu.tu_utime * 1000 / HZ, tu.tu_stime * 1000 / HZ,
+		tu.tu_nvcsw, tu.tu_nivcsw, tu.tu_minflt,
+		cu.tu_utime * 1000 / HZ, cu.tu_stime * 1000 / HZ);
+}
+
+/*
+ * Print the resource usage of every live process. Times are in
+ * milliseconds; the last two columns are for children that have
+ * exited.
+ */
+void
+proc_printusage(void)
+{
+#if OPT_A2
+	struct proc *proc;
+	unsigned i;
+#endif
+
+	kprintf("%5s %-16s %8s %8s %7s %7s %7s %8s %8s\n", "pid", "name",
+		"user", "sys", "vcsw", "ivcsw", "faults", "c-user", "c-sys");
+	proc_printoneusage(1, kproc);
+#if OPT_A2
+	rwlock_acquire_read(pid_rwlock);
+	for (i = 0; i < pid_nslots; i++) {
+		proc = pid_slots[i].ps_proc;
+		if (proc != NULL && !proc->exited) {
+			proc_printoneusage(proc->pid, proc);
+		}
+	}
+	rwlock_release_read(pid_rwlock);
+#endif
 }
 
 /*
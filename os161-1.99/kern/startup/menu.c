@@ -35,16 +35,26 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
+#include "opt-irqtrace.h"
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
+#if OPT_IRQTRACE
+#include <irqtrace.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -140,9 +150,9 @@ common_prog(int nargs, char **args)
 #endif
 
 	/* Create a process for the new program to run in. */
-	proc = proc_create_runprogram(args[0] /* name */);
-	if (proc == NULL) {
-		return ENOMEM;
+	result = proc_create_runprogram(args[0] /* name */, &proc);
+	if (result) {
+		return result;
 	}
 
 	result = thread_fork(args[0] /* thread name */,
@@ -395,10 +405,128 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	vmalloc_printstats();
 	
 	return 0;
 }
 
+/*
+ * Command for showing or setting the per-cpu thread pool size.
+ */
+static
+int
+cmd_threadpool(int nargs, char **args)
+{
+	const char *s;
+
+	if (nargs > 2) {
+		kprintf("Usage: tpool [size]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		/* atoi takes signs and trailing junk; we want digits only. */
+		for (s = args[1]; *s >= '0' && *s <= '9'; s++) {
+			/* nothing */
+		}
+		if (s == args[1] || *s != '\0') {
+			kprintf("Usage: tpool [size]\n");
+			return EINVAL;
+		}
+		thread_pool_max = atoi(args[1]);
+	}
+	kprintf("Thread pool: up to %u threads per cpu\n", thread_pool_max);
+	return 0;
+}
+
+/*
+ * Command for printing per-process resource usage.
+ */
+static
+int
+cmd_usage(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printusage();
+	return 0;
+}
+
+/*
+ * Command for printing IPI counters.
+ */
+static
+int
+cmd_ipistats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	ipi_printstats();
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+/*
+ * Command for controlling and printing lock statistics.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: lockstat [on | off | reset | sortkey]\n");
+		kprintf("    sortkey: acq, cont, spin, wait, hold, maxhold\n");
+		return EINVAL;
+	}
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockstat_enabled = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockstat_enabled = false;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else {
+		lockstat_report(nargs == 2 ? args[1] : NULL);
+	}
+	return 0;
+}
+#endif
+
+#if OPT_IRQTRACE
+/*
+ * Command for controlling and printing the interrupt-off tracer.
+ */
+static
+int
+cmd_irqtrace(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: irqtrace [on | off | reset]\n");
+		return EINVAL;
+	}
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		irqtrace_enabled = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		irqtrace_enabled = false;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		irqtrace_reset();
+	}
+	else if (nargs == 2) {
+		kprintf("Usage: irqtrace [on | off | reset]\n");
+		return EINVAL;
+	}
+	else {
+		irqtrace_report();
+	}
+	return 0;
+}
+#endif
+
 static
 int
 cmd_enabledth(int nargs, char **args) {
@@ -448,6 +576,15 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[tpool]   Thread pool size          ",
+	"[ru]      Process resource usage    ",
+	"[ipi]     IPI counters              ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock statistics          ",
+#endif
+#if OPT_IRQTRACE
+	"[irqtrace] Interrupt-off latencies  ",
+#endif
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -469,6 +606,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] vmalloc test                  ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -478,6 +616,14 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Rwlock test                   ",
+	"[sy5] Rwlock vs. lock benchmark     ",
+	"[sy6] Priority inheritance test     ",
+	"[sy7] Spinlock benchmark            ",
+	"[sy8] Sleep queue test              ",
+	"[sy9] Ping-pong benchmark           ",
+	"[co1] Callout test                  ",
+	"[co2] Timed wait test               ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -558,6 +704,15 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "tpool",	cmd_threadpool },
+	{ "ru",		cmd_usage },
+	{ "ipi",	cmd_ipistats },
+#if OPT_LOCKSTAT
+	{ "lockstat",	cmd_lockstat },
+#endif
+#if OPT_IRQTRACE
+	{ "irqtrace",	cmd_irqtrace },
+#endif
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -579,6 +734,7 @@ static struct {
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	vmalloctest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -590,6 +746,14 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	rwbench },
+	{ "sy6",	pitest },
+	{ "sy7",	spinbench },
+	{ "sy8",	sleepqtest },
+	{ "sy9",	pingpong },
+	{ "co1",	callouttest },
+	{ "co2",	timedwaittest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
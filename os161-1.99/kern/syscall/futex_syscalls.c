@@ -0,0 +1,198 @@
+/*
+ * Fast userspace synchronization ("futexes").
+ *
+ * User code keeps the state of its mutexes and condition variables
+ * in ordinary memory and changes it with atomic instructions, and
+ * only calls in here when it has to wait or has someone to wake:
+ *
+ *    futex_wait(addr, val)  Sleep until woken by futex_wake on ADDR,
+ *                           but only if *ADDR still equals VAL;
+ *                           otherwise fail at once with EAGAIN. The
+ *                           check and going to sleep are atomic with
+ *                           respect to futex_wake.
+ *    futex_wake(addr, n)    Wake up to N threads waiting on ADDR;
+ *                           returns how many were woken.
+ *
+ * Waiting threads are kept in a hash table keyed by address space and
+ * user address. There are no per-futex kernel objects: a waiter's
+ * record lives on its own kernel stack while it sleeps, and an address
+ * nobody is waiting on costs nothing.
+ *
+ * Each bucket has a sleep lock, since reading the user's word may
+ * fault, and a wait channel that all its waiters sleep on; wakeups
+ * pick out the right threads with wchan_wakethread.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <synch.h>
+#include <wchan.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+#define FUTEX_HASHSIZE	64
+
+struct futex_waiter {
+	struct futex_waiter *fw_next;
+	struct addrspace *fw_as;
+	userptr_t fw_uaddr;
+	struct thread *fw_thread;
+};
+
+struct futex_bucket {
+	struct lock fb_lock;
+	struct wchan *fb_wchan;
+	struct futex_waiter *fb_waiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASHSIZE];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		lock_init(&futex_table[i].fb_lock, "futex");
+		futex_table[i].fb_wchan = wchan_create("futex");
+		if (futex_table[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_hash(struct addrspace *as, userptr_t uaddr)
+{
+	uintptr_t h;
+
+	h = ((uintptr_t)as >> 4) ^ ((uintptr_t)uaddr >> 2);
+	h ^= h >> 8;
+	return &futex_table[h % FUTEX_HASHSIZE];
+}
+
+int
+sys_futex_wait(userptr_t uaddr, int val)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter fw, **fwp;
+	int cur, result;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	fw.fw_as = curproc_getas();
+	fw.fw_uaddr = uaddr;
+	fw.fw_thread = curthread;
+	fb = futex_hash(fw.fw_as, uaddr);
+
+	lock_acquire(&fb->fb_lock);
+	/*
+	 * If the process is exiting, futex_wakeall may already have
+	 * been through this bucket, and nobody would wake us. It sets
+	 * p_exiting before taking any bucket lock, so checking here,
+	 * with ours held, is enough.
+	 */
+	if (curproc->p_exiting) {
+		lock_release(&fb->fb_lock);
+		return EINTR;
+	}
+	result = copyin((const_userptr_t)uaddr, &cur, sizeof(cur));
+	if (result) {
+		lock_release(&fb->fb_lock);
+		return result;
+	}
+	if (cur != val) {
+		lock_release(&fb->fb_lock);
+		return EAGAIN;
+	}
+
+	/* Join the end of the line. */
+	for (fwp = &fb->fb_waiters; *fwp != NULL; fwp = &(*fwp)->fw_next) {
+		/* nothing */
+	}
+	fw.fw_next = NULL;
+	*fwp = &fw;
+
+	/*
+	 * Lock the channel before letting go of the bucket, so a
+	 * futex_wake that finds our record also finds us asleep.
+	 * Whoever wakes us takes the record off the list first.
+	 */
+	wchan_lock(fb->fb_wchan);
+	lock_release(&fb->fb_lock);
+	wchan_sleep(fb->fb_wchan);
+
+	return 0;
+}
+
+int
+sys_futex_wake(userptr_t uaddr, int n, int *retval)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter **fwp, *fw;
+	struct addrspace *as;
+	int woken;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0 || n < 0) {
+		return EINVAL;
+	}
+
+	as = curproc_getas();
+	fb = futex_hash(as, uaddr);
+
+	woken = 0;
+	lock_acquire(&fb->fb_lock);
+	fwp = &fb->fb_waiters;
+	while (woken < n && (fw = *fwp) != NULL) {
+		if (fw->fw_as != as || fw->fw_uaddr != uaddr) {
+			fwp = &fw->fw_next;
+			continue;
+		}
+		*fwp = fw->fw_next;
+		if (!wchan_wakethread(fb->fb_wchan, fw->fw_thread)) {
+			panic("futex_wake: waiter not asleep\n");
+		}
+		woken++;
+	}
+	lock_release(&fb->fb_lock);
+
+	*retval = woken;
+	return 0;
+}
+
+/*
+ * Wake everyone waiting in AS, whatever address they're waiting on,
+ * so they can notice their process is exiting.
+ */
+void
+futex_wakeall(struct addrspace *as)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter **fwp, *fw;
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		fb = &futex_table[i];
+		lock_acquire(&fb->fb_lock);
+		fwp = &fb->fb_waiters;
+		while ((fw = *fwp) != NULL) {
+			if (fw->fw_as != as) {
+				fwp = &fw->fw_next;
+				continue;
+			}
+			*fwp = fw->fw_next;
+			if (!wchan_wakethread(fb->fb_wchan, fw->fw_thread)) {
+				panic("futex_wakeall: waiter not asleep\n");
+			}
+		}
+		lock_release(&fb->fb_lock);
+	}
+}
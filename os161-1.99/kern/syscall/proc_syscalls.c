@@ -2,6 +2,8 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <syscall.h>
 #include <current.h>
@@ -12,44 +14,54 @@
 #include <copyinout.h>
 #include <mips/trapframe.h>
 #include <spl.h>
+#include <clock.h>
 #include "opt-A2.h"
 
-  /* this implementation of sys__exit does not do anything with the exit code */
-  /* this needs to be fixed to get exit() and waitpid() working properly */
 #if OPT_A2
-extern struct proc **proc_list;
-extern struct semaphore *proc_list_mutex;
-//extern struct semaphore *fork_synch;
-
 struct fork_pack {
     struct trapframe *tf;
     struct addrspace *as;
-    struct semaphore *synch;
 };
 
 
 #endif
 
 
+/*
+ * _exit ends the whole process, not just the calling thread. The
+ * other threads are stopped on their way back to user mode (see
+ * uthread_exitcheck), and whichever thread leaves last tears the
+ * process down in proc_exit.
+ */
 void sys__exit(int exitcode) {
-  struct addrspace *as;
   struct proc *p = curproc;
-  /* for now, just include this to keep the compiler from complaining about
-     an unused variable */
+
+  spinlock_acquire(&p->p_lock);
+  if (!p->p_exiting) {
+    p->p_exiting = true;
 #if OPT_A2
-  p->exitcode = exitcode;
-  P(proc_list_mutex);
-    if(proc_list[p->parent_pid] != NULL) {
-        p->exited = true;
-        cv_signal(p->waitcv, NULL);
-    } else {
-        cv_destroy(p->waitcv);
-        proc_list[p->pid] = NULL;
-    }
-  V(proc_list_mutex);
+    p->exitcode = exitcode;
 #endif
+  }
+  spinlock_release(&p->p_lock);
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
+  /* get the other threads moving; they may be asleep in the kernel */
+  lock_acquire(p->p_threadlock);
+  cv_broadcast(p->p_threadcv, p->p_threadlock);
+  lock_release(p->p_threadlock);
+  futex_wakeall(curproc_getas());
+
+  uthread_leave();
+  panic("return from uthread_leave in sys_exit\n");
+}
+
+void proc_exit(void) {
+  struct addrspace *as;
+  struct proc *p = curproc;
+
+  KASSERT(p->p_nuthreads == 1);
+
   KASSERT(curproc->p_addrspace != NULL);
   as_deactivate();
   /*
@@ -68,11 +80,12 @@ void sys__exit(int exitcode) {
 
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
+  /* with OPT_A2 it also tells our parent, and passes on our usage */
   proc_destroy(p);
   
   thread_exit();
   /* thread_exit() does not return, so we should never get here */
-  panic("return from thread_exit in sys_exit\n");
+  panic("return from thread_exit in proc_exit\n");
 }
 
 
@@ -86,8 +99,188 @@ sys_getpid(pid_t *retval)
   return(0);
 }
 
-/* stub handler for waitpid() system call                */
+/*
+ * getrusage: resource usage of the calling process, or of all its
+ * children that have exited. Times are only as fine as a hardclock.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+  struct proc *p = curproc;
+  struct threadusage tu;
+  struct rusage ru;
+
+  switch (who) {
+  case RUSAGE_SELF:
+    proc_getusage(p, &tu);
+    break;
+  case RUSAGE_CHILDREN:
+    spinlock_acquire(&p->p_lock);
+    tu = p->p_childusage;
+    spinlock_release(&p->p_lock);
+    break;
+  default:
+    return EINVAL;
+  }
+
+  bzero(&ru, sizeof(ru));
+  ru.ru_utime.tv_sec = tu.tu_utime / HZ;
+  ru.ru_utime.tv_usec = (tu.tu_utime % HZ) * (1000000 / HZ);
+  ru.ru_stime.tv_sec = tu.tu_stime / HZ;
+  ru.ru_stime.tv_usec = (tu.tu_stime % HZ) * (1000000 / HZ);
+  ru.ru_minflt = tu.tu_minflt;
+  ru.ru_nvcsw = tu.tu_nvcsw;
+  ru.ru_nivcsw = tu.tu_nivcsw;
 
+  return copyout(&ru, usage, sizeof(ru));
+}
+
+/*
+ * Find the process with pid WHO, or the caller if WHO is 0, for the
+ * scheduling calls below. There are no permissions, so anyone may
+ * change anyone's settings.
+ *
+ * On success, call sched_doneproc when finished with the result.
+ */
+static
+int
+sched_findproc(pid_t who, struct proc **ret)
+{
+#if OPT_A2
+  struct proc *p;
+
+  p = proc_lookup(who == 0 ? curproc->pid : who);
+  if (p == NULL || p->exited) {
+    proc_lookupdone();
+    return ESRCH;
+  }
+  *ret = p;
+  return 0;
+#else
+  if (who == 0) {
+    *ret = curproc;
+    return 0;
+  }
+  return ESRCH;
+#endif
+}
+
+static
+void
+sched_doneproc(void)
+{
+#if OPT_A2
+  proc_lookupdone();
+#endif
+}
+
+/*
+ * getpriority/setpriority: a process's nice value, from PRIO_MIN
+ * (most cpu) to PRIO_MAX (least); see the scheduler notes in thread.c.
+ * There are no process groups or users, so WHICH must be PRIO_PROCESS.
+ * Out-of-range values are clamped, as in BSD.
+ */
+int
+sys_getpriority(int which, pid_t who, int *retval)
+{
+  struct proc *p;
+  int result;
+
+  if (which != PRIO_PROCESS) {
+    return EINVAL;
+  }
+
+  result = sched_findproc(who, &p);
+  if (result == 0) {
+    spinlock_acquire(&p->p_lock);
+    *retval = p->p_nice;
+    spinlock_release(&p->p_lock);
+    sched_doneproc();
+  }
+  return result;
+}
+
+int
+sys_setpriority(int which, pid_t who, int prio)
+{
+  struct proc *p;
+  int result;
+
+  if (which != PRIO_PROCESS) {
+    return EINVAL;
+  }
+  if (prio < PRIO_MIN) {
+    prio = PRIO_MIN;
+  }
+  else if (prio > PRIO_MAX) {
+    prio = PRIO_MAX;
+  }
+
+  result = sched_findproc(who, &p);
+  if (result == 0) {
+    proc_setnice(p, prio);
+    sched_doneproc();
+  }
+  return result;
+}
+
+/*
+ * getaffinity/setaffinity: the cpus a process's threads may run on,
+ * as a mask with bit N for cpu N. The mask must include at least one
+ * cpu that exists; bits for cpus that don't are kept but ignored.
+ * getaffinity only reports the ones that do, so the caller can use
+ * it to find out how many there are.
+ *
+ * A caller that takes itself off the cpu it's on moves before
+ * returning.
+ */
+int
+sys_getaffinity(pid_t who, userptr_t maskptr)
+{
+  struct proc *p;
+  uint32_t mask;
+  int result;
+
+  result = sched_findproc(who, &p);
+  if (result) {
+    return result;
+  }
+  spinlock_acquire(&p->p_lock);
+  mask = p->p_cpumask;
+  spinlock_release(&p->p_lock);
+  sched_doneproc();
+
+  mask &= thread_cpumask_online();
+  return copyout(&mask, maskptr, sizeof(mask));
+}
+
+int
+sys_setaffinity(pid_t who, uint32_t mask)
+{
+  struct proc *p;
+  int result;
+
+  if ((mask & thread_cpumask_online()) == 0) {
+    return EINVAL;
+  }
+
+  result = sched_findproc(who, &p);
+  if (result) {
+    return result;
+  }
+  proc_setaffinity(p, mask);
+  sched_doneproc();
+
+  if (p == curproc) {
+    thread_yield();
+  }
+  return 0;
+}
+
+/*
+ * waitpid: collect an exited child; see proc_wait. STATUS may be
+ * NULL if the caller doesn't want it.
+ */
 int
 sys_waitpid(pid_t pid,
 	    userptr_t status,
@@ -97,19 +290,20 @@ sys_waitpid(pid_t pid,
   int exitstatus;
   int result;
 
-  /* this is just a stub implementation that always reports an
-     exit status of 0, regardless of the actual exit status of
-     the specified process.   
-     In fact, this will return 0 even if the specified process
-     is still running, and even if it never existed in the first place.
-
-     Fix this!
-  */
-
+#if OPT_A2
+  result = proc_wait(pid, options, &exitstatus, retval);
+  if (result) {
+    return result;
+  }
+  if (status == NULL || *retval == 0) {
+    return 0;
+  }
+  return copyout(&exitstatus, status, sizeof(int));
+#else
   if (options != 0) {
     return(EINVAL);
   }
-  /* for now, just pretend the exitstatus is 0 */
+  /* without OPT_A2 there's nothing to wait for; pretend it exited 0 */
   exitstatus = 0;
   result = copyout((void *)&exitstatus,status,sizeof(int));
   if (result) {
@@ -117,69 +311,99 @@ sys_waitpid(pid_t pid,
   }
   *retval = pid;
   return(0);
+#endif
 }
 #if OPT_A2
 
 
+/*
+ * fork: copy the calling process. The child gets its own copy of the
+ * trapframe to start from, which it frees once it's on its stack, so
+ * the parent doesn't need to wait for it to get going.
+ */
 int
 sys_fork(struct trapframe *tf, pid_t *retval) {
-    int err = 0;
-    struct fork_pack *pack = kmalloc(sizeof(struct fork_pack *));
+    struct fork_pack *pack;
+    struct proc *new_proc;
+    unsigned tid;
+    pid_t pid;
+    int err;
+
+    pack = kmalloc(sizeof(struct fork_pack));
+    if (pack == NULL) {
+        return ENOMEM;
+    }
+    pack->tf = kmalloc(sizeof(struct trapframe));
+    if (pack->tf == NULL) {
+        kfree(pack);
+        return ENOMEM;
+    }
+    memcpy(pack->tf, tf, sizeof(struct trapframe));
+
     //create new process
-    struct proc *new_proc = proc_create_runprogram(curproc->p_name);
-    new_proc->parent_pid = curproc->pid;
+    err = proc_create_runprogram(curproc->p_name, &new_proc);
+    if (err) {
+        kfree(pack->tf);
+        kfree(pack);
+        return err;
+    }
+    spinlock_acquire(&curproc->p_lock);
+    new_proc->p_nice = curproc->p_nice;
+    new_proc->p_cpumask = curproc->p_cpumask;
+    spinlock_release(&curproc->p_lock);
+
+    /*
+     * The child's thread carries on where we are, on our stack in
+     * the copied address space, so it takes our thread id; otherwise
+     * __thread_create in the child could hand that stack out again.
+     */
+    tid = curthread->t_tid;
+    if (tid != 0) {
+        new_proc->p_uthreads[0].ut_state = UT_FREE;
+        new_proc->p_uthreads[tid].ut_state = UT_RUNNING;
+    }
     
     // create and copy new address space
-    err = as_copy(curproc->p_addrspace,&(pack->as));
+    err = as_copy(curproc->p_addrspace, &pack->as);
     if (err) {
+        kfree(pack->tf);
+        kfree(pack);
         proc_destroy(new_proc);
         return err;
     }
-    
-    // create and copy new trap frame
-    pack->tf = (struct trapframe *)kmalloc(sizeof(struct trapframe*));
-    if(pack->tf == NULL) {
+
+    /* the child may be gone again by the time thread_fork returns */
+    pid = new_proc->pid;
+    proc_addchild(curproc, new_proc);
+    err = thread_fork(curthread->t_name, new_proc, child_entry, pack, tid);
+    if (err) {
+        /* it never ran, so there's nobody to wait for it */
+        proc_remchild(curproc, new_proc);
+        as_destroy(pack->as);
+        kfree(pack->tf);
+        kfree(pack);
         proc_destroy(new_proc);
-        kfree(pack->as);
-        return ENOMEM;
+        return err;
     }
-    memcpy(pack->tf, tf, sizeof(struct trapframe *));
-    
-    //pack->synch = sem_create("synch", 0);
-    
-    
-    void (*entry_func)(void*, unsigned long) = &child_entry;
-    
-    //P(pack->synch);
-    //V(pack->synch);
-    err = thread_fork(curthread->t_name, new_proc, entry_func, pack, 0);
-    struct lock *dummy = lock_create("dummy lock");
-    lock_acquire(dummy);
-    cv_wait(fork_synch, dummy);
-    *retval = new_proc->pid;
-    kprintf("WTF\n");
+    *retval = pid;
     return 0;
 }
 
 void
 child_entry(void* arg1, unsigned long arg2) {
-   
     struct fork_pack *pack = arg1;
-    //P(pack->synch);
-    struct trapframe *p_ntf = pack->tf;
     struct trapframe ntf;
-    //struct addrspace *as;
-    (void)arg2;
 
+    curthread->t_tid = arg2;
     curproc_setas(pack->as);
     as_activate();
     
-    memcpy(&ntf, p_ntf, sizeof(struct trapframe));
+    memcpy(&ntf, pack->tf, sizeof(struct trapframe));
+    kfree(pack->tf);
+    kfree(pack);
     ntf.tf_v0 = 0;
     ntf.tf_a3 = 0;
     ntf.tf_epc += 4;
-    cv_signal(fork_synch, NULL);
-    kprintf("LOL\n");
     mips_usermode(&ntf);
     panic("child thread escaped usermode warp!\n");
 }
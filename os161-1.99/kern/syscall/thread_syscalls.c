@@ -0,0 +1,237 @@
+/*
+ * User threads.
+ *
+ *    __thread_create(entry, a0, a1)
+ *                        Start a new thread in the calling process at
+ *                        ENTRY, with A0 and A1 in its argument
+ *                        registers, on a stack of its own. Returns its
+ *                        thread id. (libc's thread_create wraps this.)
+ *    thread_join(tid, &value)
+ *                        Wait for thread TID to call thread_exit, and
+ *                        get the value it passed. Each thread can be
+ *                        joined once, and its id isn't reused until
+ *                        it has been.
+ *    thread_exit(value)  End the calling thread. If it was the last
+ *                        one, the process exits with status 0.
+ *
+ * Each user thread is an ordinary kernel thread attached to the
+ * process, with its own kernel stack from thread_fork. Thread N runs
+ * on user stack N of the address space (see as_define_thread_stack);
+ * the thread the process started with is thread 0.
+ *
+ * The process stays around until its last thread leaves, whether by
+ * thread_exit or because some thread called _exit; that last thread
+ * tears it down in proc_exit. After _exit, the others are stopped
+ * the next time they would go back to user mode. Threads asleep in
+ * thread_join or futex_wait are woken for this; ones asleep anywhere
+ * else finish what they were doing first.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <mips/trapframe.h>
+#include <syscall.h>
+#include "opt-A2.h"
+
+/*
+ * Room left at the top of a new thread's stack, where the MIPS calling
+ * convention lets the function it starts in save its argument registers.
+ */
+#define UTHREAD_ARGSAVE	16
+
+/*
+ * First thing run by a new user thread.
+ */
+static
+void
+uthread_entry(void *data1, unsigned long tid)
+{
+	struct trapframe tf;
+
+	memcpy(&tf, data1, sizeof(tf));
+	kfree(data1);
+	curthread->t_tid = tid;
+
+	uthread_exitcheck();
+	mips_usermode(&tf);
+	panic("uthread_entry: returned from mips_usermode\n");
+}
+
+int
+sys___thread_create(struct trapframe *tf, userptr_t entry,
+		    userptr_t arg1, userptr_t arg2, int *retval)
+{
+	struct proc *p = curproc;
+	struct trapframe *ntf;
+	vaddr_t stackptr;
+	unsigned tid;
+	int result;
+
+	lock_acquire(p->p_threadlock);
+
+	for (tid=1; tid<PROC_MAXTHREADS; tid++) {
+		if (p->p_uthreads[tid].ut_state == UT_FREE) {
+			break;
+		}
+	}
+	if (tid == PROC_MAXTHREADS) {
+		lock_release(p->p_threadlock);
+		return EAGAIN;
+	}
+
+	result = as_define_thread_stack(curproc_getas(), tid, &stackptr);
+	if (result) {
+		lock_release(p->p_threadlock);
+		return result;
+	}
+
+	/*
+	 * Start from a copy of our own registers, which takes care of
+	 * things like gp, and point it at the new code and stack.
+	 */
+	ntf = kmalloc(sizeof(*ntf));
+	if (ntf == NULL) {
+		lock_release(p->p_threadlock);
+		return ENOMEM;
+	}
+	*ntf = *tf;
+	ntf->tf_epc = (vaddr_t)entry;
+	ntf->tf_a0 = (uint32_t)arg1;
+	ntf->tf_a1 = (uint32_t)arg2;
+	ntf->tf_sp = stackptr - UTHREAD_ARGSAVE;
+	ntf->tf_ra = 0;
+
+	spinlock_acquire(&p->p_lock);
+	if (p->p_exiting) {
+		spinlock_release(&p->p_lock);
+		kfree(ntf);
+		lock_release(p->p_threadlock);
+		return EINTR;
+	}
+	p->p_nuthreads++;
+	spinlock_release(&p->p_lock);
+
+	p->p_uthreads[tid].ut_state = UT_RUNNING;
+	p->p_uthreads[tid].ut_joining = false;
+	p->p_uthreads[tid].ut_retval = NULL;
+
+	result = thread_fork(curthread->t_name, p, uthread_entry, ntf, tid);
+	if (result) {
+		p->p_uthreads[tid].ut_state = UT_FREE;
+		spinlock_acquire(&p->p_lock);
+		p->p_nuthreads--;
+		spinlock_release(&p->p_lock);
+		kfree(ntf);
+		lock_release(p->p_threadlock);
+		return result;
+	}
+
+	lock_release(p->p_threadlock);
+
+	*retval = tid;
+	return 0;
+}
+
+int
+sys_thread_join(unsigned tid, userptr_t retval_ptr)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+	userptr_t value;
+
+	if (tid >= PROC_MAXTHREADS) {
+		return ESRCH;
+	}
+	if (tid == curthread->t_tid) {
+		return EINVAL;
+	}
+	ut = &p->p_uthreads[tid];
+
+	lock_acquire(p->p_threadlock);
+	if (ut->ut_state == UT_FREE) {
+		lock_release(p->p_threadlock);
+		return ESRCH;
+	}
+	if (ut->ut_joining) {
+		lock_release(p->p_threadlock);
+		return EINVAL;
+	}
+
+	ut->ut_joining = true;
+	while (ut->ut_state != UT_ZOMBIE && !p->p_exiting) {
+		cv_wait(p->p_threadcv, p->p_threadlock);
+	}
+	ut->ut_joining = false;
+	if (ut->ut_state != UT_ZOMBIE) {
+		/* The process is exiting; we'll be stopped on the way out. */
+		lock_release(p->p_threadlock);
+		return EINTR;
+	}
+	value = ut->ut_retval;
+	ut->ut_state = UT_FREE;
+	lock_release(p->p_threadlock);
+
+	if (retval_ptr == NULL) {
+		return 0;
+	}
+	return copyout(&value, retval_ptr, sizeof(value));
+}
+
+void
+sys_thread_exit(userptr_t value)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+
+	lock_acquire(p->p_threadlock);
+	ut = &p->p_uthreads[curthread->t_tid];
+	KASSERT(ut->ut_state == UT_RUNNING);
+	ut->ut_state = UT_ZOMBIE;
+	ut->ut_retval = value;
+	cv_broadcast(p->p_threadcv, p->p_threadlock);
+	lock_release(p->p_threadlock);
+
+	uthread_leave();
+	panic("sys_thread_exit: returned from uthread_leave\n");
+}
+
+/*
+ * Leave the current process. The last thread out takes the process
+ * with it.
+ */
+void
+uthread_leave(void)
+{
+	if (!proc_remuthread(curthread)) {
+#if OPT_A2
+		struct proc *p = curproc;
+
+		/* Last one; if nobody called _exit, it's a normal exit. */
+		spinlock_acquire(&p->p_lock);
+		if (!p->p_exiting) {
+			p->p_exiting = true;
+			p->exitcode = 0;
+		}
+		spinlock_release(&p->p_lock);
+#endif
+		proc_exit();
+	}
+	thread_exit();
+}
+
+/*
+ * Called on the way back to user mode. Interrupts must be on.
+ */
+void
+uthread_exitcheck(void)
+{
+	if (curproc->p_exiting) {
+		uthread_leave();
+	}
+}
@@ -28,7 +28,10 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <clock.h>
+#include <callout.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -56,3 +59,49 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the time given in REQ, rounded up to whole hardclock
+ * ticks. Nothing can interrupt the sleep, so if REM is given the
+ * time remaining is always zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req, rem;
+	const uint32_t nsecsperhz = 1000000000 / HZ;
+	uint64_t ticks;
+	int result;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	ticks = (uint64_t)req.tv_sec * HZ +
+		(req.tv_nsec + nsecsperhz - 1) / nsecsperhz;
+	while (ticks > 0) {
+		/* Long sleeps are taken in pieces the callouts can handle */
+		if (ticks > CALLOUT_MAXTICKS) {
+			clocksleep_ticks(CALLOUT_MAXTICKS);
+			ticks -= CALLOUT_MAXTICKS;
+		}
+		else {
+			clocksleep_ticks(ticks);
+			ticks = 0;
+		}
+	}
+
+	if (user_rem != NULL) {
+		rem.tv_sec = 0;
+		rem.tv_nsec = 0;
+		result = copyout(&rem, user_rem, sizeof(rem));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
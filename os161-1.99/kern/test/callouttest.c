@@ -0,0 +1,258 @@
+/*
+ * Callout and timed wait tests.
+ *
+ * co1 schedules a batch of callouts at delays that land in different
+ * levels of the timing wheel, cancels some of them, and checks that
+ * the rest fire in order and no earlier than they should.
+ *
+ * co2 checks sem_timedwait, cv_timedwait and clocksleep_ticks: that
+ * timeouts happen and take about as long as they should, and that a
+ * wakeup before the timeout is reported as such.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <callout.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+/* Delays, in hardclocks; covers levels 0 and 1 of the wheel. */
+static const unsigned co_delays[] = { 1, 2, 7, 63, 64, 65, 100, 130, 250 };
+#define NCALLOUTS (sizeof(co_delays) / sizeof(co_delays[0]))
+
+struct cotest {
+	unsigned ct_index;
+	time_t ct_secs;
+	uint32_t ct_nsecs;
+	volatile bool ct_fired;
+};
+
+static struct cotest cotests[NCALLOUTS];
+static struct callout cocallouts[NCALLOUTS];
+static struct semaphore *cosem;
+static volatile unsigned coorder[NCALLOUTS];
+static volatile unsigned conumfired;
+
+/*
+ * Convert an interval to hardclocks, rounding down.
+ */
+static
+unsigned
+interval_ticks(time_t secs1, uint32_t nsecs1, time_t secs2, uint32_t nsecs2)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	return secs * HZ + nsecs / (1000000000 / HZ);
+}
+
+static
+void
+cotest_fire(void *vct)
+{
+	struct cotest *ct = vct;
+
+	gettime(&ct->ct_secs, &ct->ct_nsecs);
+	ct->ct_fired = true;
+	coorder[conumfired++] = ct->ct_index;
+	V(cosem);
+}
+
+int
+callouttest(int nargs, char **args)
+{
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i, expected, elapsed, prev;
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	cosem = sem_create("callouttest", 0);
+	if (cosem == NULL) {
+		panic("callouttest: sem_create failed\n");
+	}
+
+	kprintf("Starting callout test...\n");
+
+	conumfired = 0;
+	gettime(&secs, &nsecs);
+	/* Schedule in reverse, so the wheel has to sort them out. */
+	for (i=NCALLOUTS; i-- > 0; ) {
+		cotests[i].ct_index = i;
+		cotests[i].ct_fired = false;
+		callout_init(&cocallouts[i], cotest_fire, &cotests[i]);
+		callout_schedule(&cocallouts[i], co_delays[i]);
+	}
+
+	/* Cancel every third one. */
+	expected = 0;
+	for (i=0; i<NCALLOUTS; i++) {
+		if (i % 3 == 2) {
+			if (!callout_stop(&cocallouts[i])) {
+				kprintf("callout %u: fired before cancel\n",
+					i);
+				expected++;
+			}
+		}
+		else {
+			expected++;
+		}
+	}
+
+	for (i=0; i<expected; i++) {
+		P(cosem);
+	}
+
+	ok = true;
+	prev = 0;
+	for (i=0; i<conumfired; i++) {
+		if (coorder[i] < prev) {
+			kprintf("callout %u fired after callout %u\n",
+				coorder[i], prev);
+			ok = false;
+		}
+		prev = coorder[i];
+	}
+	for (i=0; i<NCALLOUTS; i++) {
+		if (!cotests[i].ct_fired) {
+			continue;
+		}
+		elapsed = interval_ticks(secs, nsecs, cotests[i].ct_secs,
+					 cotests[i].ct_nsecs);
+		kprintf("callout %u: delay %u, fired after %u\n",
+			i, co_delays[i], elapsed);
+		if (elapsed + 1 < co_delays[i]) {
+			kprintf("callout %u: fired early\n", i);
+			ok = false;
+		}
+	}
+
+	sem_destroy(cosem);
+	cosem = NULL;
+
+	kprintf("Callout test %s.\n", ok ? "done" : "FAILED");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+#define TW_TICKS	20
+
+static struct semaphore *twsem;
+static struct lock *twlock;
+static struct cv *twcv;
+static volatile bool twflag;
+
+static
+void
+twsignaller(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	clocksleep_ticks(TW_TICKS / 4);
+	lock_acquire(twlock);
+	twflag = true;
+	cv_signal(twcv, twlock);
+	lock_release(twlock);
+}
+
+/*
+ * Check that a timed wait took about TICKS hardclocks.
+ */
+static
+bool
+twcheck(const char *what, time_t secs, uint32_t nsecs, unsigned ticks)
+{
+	time_t secs2;
+	uint32_t nsecs2;
+	unsigned elapsed;
+
+	gettime(&secs2, &nsecs2);
+	elapsed = interval_ticks(secs, nsecs, secs2, nsecs2);
+	kprintf("%s: %u hardclocks (wanted %u)\n", what, elapsed, ticks);
+	if (elapsed + 1 < ticks) {
+		kprintf("%s: woke up too soon\n", what);
+		return false;
+	}
+	return true;
+}
+
+int
+timedwaittest(int nargs, char **args)
+{
+	time_t secs;
+	uint32_t nsecs;
+	bool ok;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	twsem = sem_create("twsem", 0);
+	twlock = lock_create("twlock");
+	twcv = cv_create("twcv");
+	if (twsem == NULL || twlock == NULL || twcv == NULL) {
+		panic("timedwaittest: out of memory\n");
+	}
+
+	kprintf("Starting timed wait test...\n");
+	ok = true;
+
+	gettime(&secs, &nsecs);
+	clocksleep_ticks(TW_TICKS);
+	ok = twcheck("clocksleep_ticks", secs, nsecs, TW_TICKS) && ok;
+
+	gettime(&secs, &nsecs);
+	result = sem_timedwait(twsem, TW_TICKS);
+	if (result != ETIMEDOUT) {
+		kprintf("sem_timedwait: returned %d, not ETIMEDOUT\n", result);
+		ok = false;
+	}
+	ok = twcheck("sem_timedwait", secs, nsecs, TW_TICKS) && ok;
+
+	V(twsem);
+	result = sem_timedwait(twsem, TW_TICKS);
+	if (result != 0) {
+		kprintf("sem_timedwait: failed with count available\n");
+		ok = false;
+	}
+
+	lock_acquire(twlock);
+	gettime(&secs, &nsecs);
+	result = cv_timedwait(twcv, twlock, TW_TICKS);
+	if (result != ETIMEDOUT || !lock_do_i_hold(twlock)) {
+		kprintf("cv_timedwait: returned %d, not ETIMEDOUT\n", result);
+		ok = false;
+	}
+	ok = twcheck("cv_timedwait", secs, nsecs, TW_TICKS) && ok;
+
+	twflag = false;
+	result = thread_fork("twsignaller", NULL, twsignaller, NULL, 0);
+	if (result) {
+		panic("timedwaittest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	while (!twflag) {
+		result = cv_timedwait(twcv, twlock, 10 * TW_TICKS);
+		if (result == ETIMEDOUT && !twflag) {
+			kprintf("cv_timedwait: signal was lost\n");
+			ok = false;
+			break;
+		}
+	}
+	lock_release(twlock);
+
+	cv_destroy(twcv);
+	lock_destroy(twlock);
+	sem_destroy(twsem);
+
+	kprintf("Timed wait test %s.\n", ok ? "done" : "FAILED");
+	return 0;
+}
@@ -31,10 +31,12 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
+#include <vm.h>
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -137,3 +139,61 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Test vmalloc: grab a handful of multi-page buffers, scribble a
+ * different pattern into each, check nobody stepped on anybody else,
+ * and give them back.
+ */
+
+#define VMTRIES  16
+#define VMPAGES   5
+
+int
+vmalloctest(int nargs, char **args)
+{
+	uint32_t *bufs[VMTRIES];
+	unsigned words, i, j;
+	int errors = 0;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting vmalloc test...\n");
+
+	words = VMPAGES * PAGE_SIZE / sizeof(uint32_t);
+	for (i=0; i<VMTRIES; i++) {
+		bufs[i] = vmalloc(VMPAGES * PAGE_SIZE);
+		if (bufs[i] == NULL) {
+			kprintf("vmalloc returned null; test failed.\n");
+			while (i > 0) {
+				vfree(bufs[--i]);
+			}
+			return ENOMEM;
+		}
+		for (j=0; j<words; j++) {
+			bufs[i][j] = (i << 24) ^ j;
+		}
+	}
+
+	for (i=0; i<VMTRIES; i++) {
+		for (j=0; j<words; j++) {
+			if (bufs[i][j] != ((i << 24) ^ j)) {
+				errors++;
+			}
+		}
+	}
+
+	for (i=0; i<VMTRIES; i++) {
+		vfree(bufs[i]);
+	}
+	vmalloc_printstats();
+
+	if (errors) {
+		kprintf("vmalloc test: %d words corrupted; test failed.\n",
+			errors);
+		return EINVAL;
+	}
+	kprintf("vmalloc test done\n");
+	return 0;
+}
@@ -32,9 +32,12 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
+#include <spl.h>
 #include <thread.h>
+#include <current.h>
 #include <synch.h>
 #include <test.h>
 
@@ -347,3 +350,864 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock tests.
+//
+// sy4 checks the rwlock invariants: no reader ever sees a writer
+// inside, no writer ever sees anybody else inside, and readers
+// really do overlap. It runs once preferring writers and once with
+// reader bias.
+//
+// sy5 compares throughput of an rwlock against a plain lock for
+// various read/write mixes.
+
+#define NRWLOOPS	200
+#define NRWTHREADS	16
+#define RWWRITERS	4	/* every 4th thread writes */
+
+static struct rwlock *testrw;
+static struct lock *benchlock;
+static struct semaphore *rwdonesem;
+static struct spinlock rwcount_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwreaders_in;
+static volatile unsigned rwwriters_in;
+static volatile unsigned rwmaxreaders;
+static volatile bool rwfailed;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwfailed = true;
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % RWWRITERS == 0) {
+			rwlock_acquire_write(testrw);
+			spinlock_acquire(&rwcount_lock);
+			if (rwreaders_in > 0 || rwwriters_in > 0) {
+				rwfail(num, "writer is not alone");
+			}
+			rwwriters_in++;
+			spinlock_release(&rwcount_lock);
+
+			testval1 = num;
+			testval2 = num*num;
+			for (j=0; j<100; j++);
+			if (testval2 != testval1*testval1) {
+				rwfail(num, "writer saw testval1/testval2 change");
+			}
+
+			spinlock_acquire(&rwcount_lock);
+			rwwriters_in--;
+			spinlock_release(&rwcount_lock);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			spinlock_acquire(&rwcount_lock);
+			if (rwwriters_in > 0) {
+				rwfail(num, "reader saw a writer");
+			}
+			rwreaders_in++;
+			if (rwreaders_in > rwmaxreaders) {
+				rwmaxreaders = rwreaders_in;
+			}
+			spinlock_release(&rwcount_lock);
+
+			if (testval2 != testval1*testval1) {
+				rwfail(num, "reader saw a partial write");
+			}
+			for (j=0; j<100; j++);
+
+			spinlock_acquire(&rwcount_lock);
+			rwreaders_in--;
+			spinlock_release(&rwcount_lock);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(rwdonesem);
+}
+
+static
+void
+rwtestrun(bool readerbias)
+{
+	int i, result;
+
+	rwlock_setreaderbias(testrw, readerbias);
+	rwreaders_in = rwwriters_in = rwmaxreaders = 0;
+	testval1 = testval2 = 0;
+
+	for (i=0; i<NRWTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWTHREADS; i++) {
+		P(rwdonesem);
+	}
+	kprintf("%s: up to %u readers at once\n",
+		readerbias ? "reader bias" : "writer preference",
+		rwmaxreaders);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	testrw = rwlock_create("testrw");
+	rwdonesem = sem_create("rwdonesem", 0);
+	if (testrw == NULL || rwdonesem == NULL) {
+		panic("rwtest: out of memory\n");
+	}
+	kprintf("Starting rwlock test...\n");
+
+	rwfailed = false;
+	rwtestrun(false);
+	rwtestrun(true);
+
+	sem_destroy(rwdonesem);
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("Rwlock test %s.\n", rwfailed ? "FAILED" : "done");
+	return 0;
+}
+
+#define NBENCHTHREADS	8
+#define NBENCHOPS	1000
+#define BENCHWORK	200	/* loop iterations inside the lock */
+
+static volatile unsigned benchreadpct;
+static volatile bool benchuserw;
+
+static
+void
+rwbenchthread(void *junk, unsigned long num)
+{
+	unsigned i;
+	bool reading;
+	volatile int j;
+
+	(void)junk;
+
+	for (i=0; i<NBENCHOPS; i++) {
+		/* Spread the writes out evenly across threads and time */
+		reading = ((i * 37 + num * 11) % 100) < benchreadpct;
+		if (!benchuserw) {
+			lock_acquire(benchlock);
+		}
+		else if (reading) {
+			rwlock_acquire_read(testrw);
+		}
+		else {
+			rwlock_acquire_write(testrw);
+		}
+
+		for (j=0; j<BENCHWORK; j++);
+
+		if (!benchuserw) {
+			lock_release(benchlock);
+		}
+		else if (reading) {
+			rwlock_release_read(testrw);
+		}
+		else {
+			rwlock_release_write(testrw);
+		}
+	}
+	V(rwdonesem);
+}
+
+/*
+ * Run one benchmark pass; returns operations per second.
+ */
+static
+unsigned
+rwbenchrun(bool userw, unsigned readpct)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t usecs;
+	int i, result;
+
+	benchuserw = userw;
+	benchreadpct = readpct;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NBENCHTHREADS; i++) {
+		result = thread_fork("rwbench", NULL, rwbenchthread, NULL, i);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NBENCHTHREADS; i++) {
+		P(rwdonesem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	return (uint64_t)NBENCHTHREADS * NBENCHOPS * 1000000 / usecs;
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	static const unsigned mixes[] = { 50, 90, 99, 100 };
+	unsigned i, lockops, rwops;
+
+	(void)nargs;
+	(void)args;
+
+	testrw = rwlock_create("rwbench");
+	benchlock = lock_create("rwbench");
+	rwdonesem = sem_create("rwdonesem", 0);
+	if (testrw == NULL || benchlock == NULL || rwdonesem == NULL) {
+		panic("rwbench: out of memory\n");
+	}
+
+	kprintf("Starting rwlock benchmark: %d threads, %d ops each\n",
+		NBENCHTHREADS, NBENCHOPS);
+	kprintf("  read%%    lock ops/s  rwlock ops/s\n");
+	for (i=0; i<sizeof(mixes)/sizeof(mixes[0]); i++) {
+		lockops = rwbenchrun(false, mixes[i]);
+		rwops = rwbenchrun(true, mixes[i]);
+		kprintf("  %5u  %12u  %12u\n", mixes[i], lockops, rwops);
+	}
+
+	sem_destroy(rwdonesem);
+	lock_destroy(benchlock);
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("Rwlock benchmark done.\n");
+	return 0;
+}
+
+/*
+ * Priority inheritance test.
+ *
+ * A CPU-bound thread that has sunk to the bottom scheduling level
+ * keeps taking a lock and doing some work while holding it. A thread
+ * that sleeps a lot, and so stays near the top level, repeatedly
+ * wakes up and takes the same lock, and we measure how long it has
+ * to wait. Meanwhile enough other CPU-bound threads run to keep every
+ * cpu busy (in any usual configuration), so without priority
+ * inheritance the lock holder has to take turns with them while the
+ * waiter is stuck; with it, the holder runs at the waiter's level
+ * until it lets go.
+ *
+ * First, though, we check the mechanism directly: while we're asleep
+ * waiting for a lock, its holder must have inherited the level we're
+ * waiting at, and once it lets go it must have nothing inherited.
+ * That part can fail. Then the timing runs go with inheritance off
+ * and then on, and print the worst and average waits for each.
+ * Timing on System/161 depends on the configuration, so those are
+ * only reported.
+ */
+
+#define PIHOGS		16
+#define PIROUNDS	100
+#define PIHOLDWORK	20000	/* loop iterations with the lock held */
+#define PICHECKTICKS	HZ	/* how long the holder waits for a waiter */
+
+static struct lock *pilock;
+static struct semaphore *pidonesem;
+static volatile bool pistop;
+static volatile bool pifailed;
+
+static
+void
+pifail(const char *msg)
+{
+	kprintf("  %s\n", msg);
+	pifailed = true;
+}
+
+/*
+ * Take the lock, wait for WAITER to go to sleep on it, and check the
+ * level we inherit from it.
+ */
+static
+void
+picheckthread(void *vwaiter, unsigned long num)
+{
+	struct thread *waiter = vwaiter;
+	unsigned i;
+
+	(void)num;
+
+	lock_acquire(pilock);
+	V(pidonesem);
+
+	for (i=0; i<PICHECKTICKS && curthread->t_pi_level == MLFQ_LEVELS; i++) {
+		clocksleep_ticks(1);
+	}
+	if (curthread->t_pi_level == MLFQ_LEVELS) {
+		pifail("holder never inherited the waiter's level");
+	}
+	else if (curthread->t_pi_level != waiter->t_pi_waitlevel) {
+		pifail("holder inherited a level other than the waiter's");
+	}
+
+	lock_release(pilock);
+	if (curthread->t_pi_level != MLFQ_LEVELS) {
+		pifail("holder kept the waiter's level after lock_release");
+	}
+	V(pidonesem);
+}
+
+static
+void
+picheck(void)
+{
+	int result;
+
+	lock_pi_enabled = true;
+	result = thread_fork("picheck", NULL, picheckthread, curthread, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pidonesem);
+	lock_acquire(pilock);
+	lock_release(pilock);
+	P(pidonesem);
+}
+
+static
+void
+pispin(unsigned n)
+{
+	volatile unsigned i;
+
+	for (i=0; i<n; i++);
+}
+
+static
+void
+pihogthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	while (!pistop) {
+		pispin(1000);
+	}
+	V(pidonesem);
+}
+
+static
+void
+piholderthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	while (!pistop) {
+		lock_acquire(pilock);
+		pispin(PIHOLDWORK);
+		lock_release(pilock);
+		pispin(PIHOLDWORK / 4);
+	}
+	V(pidonesem);
+}
+
+/*
+ * Run one pass; returns the worst wait, and the average in *AVG,
+ * both in microseconds.
+ */
+static
+uint64_t
+pirun(bool inherit, uint64_t *avg)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t usecs, worst, total;
+	unsigned i, nthreads;
+	int result;
+
+	lock_pi_enabled = inherit;
+	pistop = false;
+
+	nthreads = PIHOGS;
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("pihog", NULL, pihogthread, NULL, i);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("piholder", NULL, piholderthread, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	nthreads++;
+
+	/* Give everyone time to use up their quanta and sink. */
+	clocksleep_ticks(HZ / 2);
+
+	worst = total = 0;
+	for (i=0; i<PIROUNDS; i++) {
+		clocksleep_ticks(1);
+		gettime(&secs1, &nsecs1);
+		lock_acquire(pilock);
+		gettime(&secs2, &nsecs2);
+		lock_release(pilock);
+
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+		usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+		total += usecs;
+		if (usecs > worst) {
+			worst = usecs;
+		}
+	}
+
+	pistop = true;
+	for (i=0; i<nthreads; i++) {
+		P(pidonesem);
+	}
+
+	*avg = total / PIROUNDS;
+	return worst;
+}
+
+int
+pitest(int nargs, char **args)
+{
+	uint64_t worst, avg;
+	bool saved;
+
+	(void)nargs;
+	(void)args;
+
+	pilock = lock_create("pilock");
+	pidonesem = sem_create("pidonesem", 0);
+	if (pilock == NULL || pidonesem == NULL) {
+		panic("pitest: out of memory\n");
+	}
+
+	kprintf("Starting priority inheritance test: %u hogs, %u rounds\n",
+		PIHOGS, PIROUNDS);
+	saved = lock_pi_enabled;
+	pifailed = false;
+
+	picheck();
+	if (!pifailed) {
+		kprintf("  holder inherits and gives back the waiter's level\n");
+	}
+
+	worst = pirun(false, &avg);
+	kprintf("  without inheritance: worst wait %llu us, average %llu us\n",
+		worst, avg);
+	worst = pirun(true, &avg);
+	kprintf("  with inheritance:    worst wait %llu us, average %llu us\n",
+		worst, avg);
+
+	lock_pi_enabled = saved;
+	sem_destroy(pidonesem);
+	lock_destroy(pilock);
+
+	kprintf("Priority inheritance test %s.\n",
+		pifailed ? "FAILED" : "done");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Spinlock benchmark: threads hammer one hot spinlock with a short
+ * critical section, the way the coremap and run queue locks get hit,
+ * once with the real (queued) spinlock and once with a plain
+ * test-and-test-and-set lock like the one it replaced. Reports
+ * acquisitions per second and the longest any cpu waited. Run with
+ * as many cpus as you can; 8 makes the difference show.
+ */
+
+#define NSPINTHREADS	8
+#define NSPINOPS	2000
+#define SPINHOLDWORK	50	/* loop iterations inside the lock */
+#define SPINOUTWORK	100	/* ...and between acquisitions */
+
+static struct spinlock spinbench_lock;
+static volatile spinlock_data_t spinbench_word;
+static volatile bool spinbench_queued;
+static volatile unsigned spinbench_count;
+static uint64_t spinbench_worst[NSPINTHREADS];
+static struct semaphore *spinbench_donesem;
+
+static
+uint64_t
+spinbench_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+spinbenchthread(void *junk, unsigned long num)
+{
+	uint64_t start, waited, worst;
+	unsigned i;
+	volatile int j;
+	int spl;
+
+	(void)junk;
+
+	worst = 0;
+	for (i=0; i<NSPINOPS; i++) {
+		start = spinbench_now();
+		if (spinbench_queued) {
+			spinlock_acquire(&spinbench_lock);
+		}
+		else {
+			spl = splhigh();
+			while (spinlock_data_get(&spinbench_word) != 0 ||
+			       spinlock_data_testandset(&spinbench_word) != 0) {
+				/* spin */
+			}
+		}
+		waited = spinbench_now() - start;
+		if (waited > worst) {
+			worst = waited;
+		}
+
+		/* Not atomic; only correct if the lock works. */
+		spinbench_count = spinbench_count + 1;
+		for (j=0; j<SPINHOLDWORK; j++);
+
+		if (spinbench_queued) {
+			spinlock_release(&spinbench_lock);
+		}
+		else {
+			spinlock_data_set(&spinbench_word, 0);
+			splx(spl);
+		}
+		for (j=0; j<SPINOUTWORK; j++);
+	}
+	spinbench_worst[num] = worst;
+	V(spinbench_donesem);
+}
+
+/*
+ * Run one pass; returns acquisitions per second, and the worst wait
+ * in microseconds in *WORST.
+ */
+static
+unsigned
+spinbenchrun(bool queued, uint64_t *worst)
+{
+	uint64_t start, usecs;
+	unsigned i;
+	int result;
+
+	spinbench_queued = queued;
+	spinbench_count = 0;
+
+	start = spinbench_now();
+	for (i=0; i<NSPINTHREADS; i++) {
+		result = thread_fork("spinbench", NULL, spinbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NSPINTHREADS; i++) {
+		P(spinbench_donesem);
+	}
+	usecs = (spinbench_now() - start) / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+
+	if (spinbench_count != NSPINTHREADS * NSPINOPS) {
+		panic("spinbench: count is %u, should be %u\n",
+		      spinbench_count, NSPINTHREADS * NSPINOPS);
+	}
+
+	*worst = 0;
+	for (i=0; i<NSPINTHREADS; i++) {
+		if (spinbench_worst[i] > *worst) {
+			*worst = spinbench_worst[i];
+		}
+	}
+	*worst /= 1000;
+	return (uint64_t)NSPINTHREADS * NSPINOPS * 1000000 / usecs;
+}
+
+int
+spinbench(int nargs, char **args)
+{
+	uint64_t worst;
+	unsigned ops;
+
+	(void)nargs;
+	(void)args;
+
+	spinlock_init(&spinbench_lock);
+	spinlock_data_set(&spinbench_word, 0);
+	spinbench_donesem = sem_create("spinbench", 0);
+	if (spinbench_donesem == NULL) {
+		panic("spinbench: out of memory\n");
+	}
+
+	kprintf("Starting spinlock benchmark: %d threads, %d ops each\n",
+		NSPINTHREADS, NSPINOPS);
+	kprintf("  %-12s  %10s  %15s\n", "lock", "acquires/s",
+		"worst wait (us)");
+	ops = spinbenchrun(false, &worst);
+	kprintf("  %-12s  %10u  %15llu\n", "test-and-set", ops, worst);
+	ops = spinbenchrun(true, &worst);
+	kprintf("  %-12s  %10u  %15llu\n", "queued", ops, worst);
+
+	sem_destroy(spinbench_donesem);
+	spinlock_cleanup(&spinbench_lock);
+
+	kprintf("Spinlock benchmark done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Sleep queue test: more semaphores than there are sleep queues, so
+ * some have to share, each with a thread asleep on it. They're
+ * signalled one at a time in a scrambled order, and each V must wake
+ * the thread waiting on that semaphore and no other. Everything is
+ * statically allocated, with the threads checking in through a
+ * statically initialized lock and CV.
+ */
+
+#define NSQSEMS		96	/* more than SLEEPQ_SIZE */
+#define SQSTRIDE	37	/* prime to NSQSEMS, for the order */
+
+static struct semaphore sqsems[NSQSEMS];
+static struct lock sqlock = LOCK_INITIALIZER("sqlock");
+static struct cv sqcv = CV_INITIALIZER("sqcv");
+static volatile unsigned long sqwoken;
+static volatile bool sqchecked;
+
+static
+void
+sqthread(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	P(&sqsems[num]);
+
+	lock_acquire(&sqlock);
+	sqwoken = num;
+	sqchecked = true;
+	cv_signal(&sqcv, &sqlock);
+	lock_release(&sqlock);
+}
+
+int
+sleepqtest(int nargs, char **args)
+{
+	unsigned i, k;
+	bool ok;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting sleep queue test...\n");
+
+	for (i=0; i<NSQSEMS; i++) {
+		sem_init(&sqsems[i], "sqsem", 0);
+	}
+	for (i=0; i<NSQSEMS; i++) {
+		result = thread_fork("sqthread", NULL, sqthread, NULL, i);
+		if (result) {
+			panic("sleepqtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/* Let them all get to sleep. */
+	clocksleep_ticks(HZ / 4);
+
+	ok = true;
+	lock_acquire(&sqlock);
+	for (i=0; i<NSQSEMS; i++) {
+		k = (i * SQSTRIDE) % NSQSEMS;
+		sqchecked = false;
+		V(&sqsems[k]);
+		while (!sqchecked) {
+			result = cv_timedwait(&sqcv, &sqlock, HZ);
+			if (result == ETIMEDOUT && !sqchecked) {
+				break;
+			}
+		}
+		if (!sqchecked) {
+			kprintf("sleepqtest: V of %u woke nobody\n", k);
+			ok = false;
+			break;
+		}
+		if (sqwoken != k) {
+			kprintf("sleepqtest: V of %u woke thread %lu\n",
+				k, sqwoken);
+			ok = false;
+		}
+	}
+	lock_release(&sqlock);
+
+	if (ok) {
+		for (i=0; i<NSQSEMS; i++) {
+			sem_cleanup(&sqsems[i]);
+		}
+	}
+
+	kprintf("Sleep queue test %s.\n", ok ? "done" : "FAILED");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Ping-pong benchmark: two threads take turns through a pair of
+ * semaphores, each V immediately followed by a P, and then through a
+ * lock and CV the same way. Reports the average round trip with and
+ * without direct handoff (see thread.c).
+ */
+
+#define NPINGPONG	2000
+
+static struct semaphore ppsem1 = SEMAPHORE_INITIALIZER("ppsem1", 0);
+static struct semaphore ppsem2 = SEMAPHORE_INITIALIZER("ppsem2", 0);
+static struct semaphore ppdonesem = SEMAPHORE_INITIALIZER("ppdone", 0);
+static struct lock pplock = LOCK_INITIALIZER("pplock");
+static struct cv ppcv = CV_INITIALIZER("ppcv");
+static volatile unsigned ppturn;
+
+static
+void
+ppsemthread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NPINGPONG; i++) {
+		P(&ppsem1);
+		V(&ppsem2);
+	}
+	V(&ppdonesem);
+}
+
+static
+void
+ppcvthread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	lock_acquire(&pplock);
+	for (i=0; i<NPINGPONG; i++) {
+		while (ppturn != 1) {
+			cv_wait(&ppcv, &pplock);
+		}
+		ppturn = 0;
+		cv_signal(&ppcv, &pplock);
+	}
+	lock_release(&pplock);
+	V(&ppdonesem);
+}
+
+/*
+ * Run one pass; returns the average round trip in nanoseconds.
+ */
+static
+uint64_t
+pprun(bool usecv)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	unsigned i;
+	int result;
+
+	result = thread_fork("pingpong", NULL,
+			     usecv ? ppcvthread : ppsemthread, NULL, 0);
+	if (result) {
+		panic("pingpong: thread_fork failed: %s\n", strerror(result));
+	}
+
+	gettime(&secs1, &nsecs1);
+	if (usecv) {
+		lock_acquire(&pplock);
+		ppturn = 0;
+		for (i=0; i<NPINGPONG; i++) {
+			ppturn = 1;
+			cv_signal(&ppcv, &pplock);
+			while (ppturn != 0) {
+				cv_wait(&ppcv, &pplock);
+			}
+		}
+		lock_release(&pplock);
+	}
+	else {
+		for (i=0; i<NPINGPONG; i++) {
+			V(&ppsem1);
+			P(&ppsem2);
+		}
+	}
+	gettime(&secs2, &nsecs2);
+	P(&ppdonesem);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	return ((uint64_t)secs * 1000000000 + nsecs) / NPINGPONG;
+}
+
+int
+pingpong(int nargs, char **args)
+{
+	bool saved;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting ping-pong benchmark: %d round trips\n", NPINGPONG);
+	kprintf("  %-12s  %15s  %15s\n", "", "sem (ns)", "cv (ns)");
+	saved = thread_handoff_enabled;
+
+	thread_handoff_enabled = false;
+	kprintf("  %-12s  %15llu  ", "no handoff", pprun(false));
+	kprintf("%15llu\n", pprun(true));
+	thread_handoff_enabled = true;
+	kprintf("  %-12s  %15llu  ", "handoff", pprun(false));
+	kprintf("%15llu\n", pprun(true));
+
+	thread_handoff_enabled = saved;
+	kprintf("Ping-pong benchmark done.\n");
+	return 0;
+}
@@ -0,0 +1,303 @@
+/*
+ * Callouts: a per-cpu hierarchical timing wheel.
+ *
+ * Time is counted in hardclock ticks since boot, taken from the
+ * real-time clock rather than from counting timer interrupts, because
+ * tickless cpus (see clock.c) skip interrupts and don't know exactly
+ * how many they skipped.
+ *
+ * A callout due in fewer than CALLOUT_SLOTS ticks goes in level 0,
+ * in the slot for its exact tick. Later ones go in a coarser level,
+ * in the slot covering their tick. Whenever level 0 wraps around,
+ * the next level 1 slot is "cascaded": its callouts are reinserted,
+ * which spreads them out over level 0; level 1 wrapping cascades
+ * level 2, and so on. Scheduling and cancelling are constant time,
+ * and each callout is touched at most CALLOUT_LEVELS times.
+ *
+ * An empty wheel isn't advanced at all; cw_now is reset to the
+ * current time when the first callout is added (except from inside a
+ * callout function, while callout_hardclock is still using it).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <clock.h>
+#include <callout.h>
+#include <current.h>
+
+/*
+ * The current time, in ticks.
+ */
+uint64_t
+callout_clock(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * HZ + nsecs / (1000000000 / HZ);
+}
+
+/*
+ * Put CO in the slot of W where it belongs. Wheel locked.
+ */
+static
+void
+callout_insert(struct callout_wheel *w, struct callout *co)
+{
+	uint64_t delta;
+	unsigned level, slot;
+	struct callout **head;
+
+	if (co->co_expire < w->cw_now) {
+		/* Overdue; do it at the next tick we process. */
+		co->co_expire = w->cw_now;
+	}
+	delta = co->co_expire - w->cw_now;
+	if (delta > CALLOUT_MAXTICKS) {
+		delta = CALLOUT_MAXTICKS;
+		co->co_expire = w->cw_now + delta;
+	}
+
+	for (level = 0; level < CALLOUT_LEVELS - 1; level++) {
+		if (delta < (1ULL << (CALLOUT_SLOTBITS * (level + 1)))) {
+			break;
+		}
+	}
+	slot = (co->co_expire >> (CALLOUT_SLOTBITS * level)) &
+		(CALLOUT_SLOTS - 1);
+
+	head = &w->cw_slots[level][slot];
+	co->co_next = *head;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = &co->co_next;
+	}
+	co->co_prevp = head;
+	*head = co;
+}
+
+/*
+ * Take CO out of whatever slot it's in. Wheel locked.
+ */
+static
+void
+callout_unlink(struct callout *co)
+{
+	KASSERT(co->co_prevp != NULL);
+
+	*co->co_prevp = co->co_next;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = co->co_prevp;
+	}
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+}
+
+/*
+ * Reinsert everything in slot SLOT of level LEVEL. Wheel locked.
+ */
+static
+void
+callout_cascade(struct callout_wheel *w, unsigned level, unsigned slot)
+{
+	struct callout *co, *next;
+
+	co = w->cw_slots[level][slot];
+	w->cw_slots[level][slot] = NULL;
+	while (co != NULL) {
+		next = co->co_next;
+		callout_insert(w, co);
+		co = next;
+	}
+}
+
+void
+callout_wheel_init(struct callout_wheel *w)
+{
+	unsigned i, j;
+
+	spinlock_init(&w->cw_lock);
+	w->cw_now = 0;
+	w->cw_count = 0;
+	w->cw_running = NULL;
+	for (i=0; i<CALLOUT_LEVELS; i++) {
+		for (j=0; j<CALLOUT_SLOTS; j++) {
+			w->cw_slots[i][j] = NULL;
+		}
+	}
+}
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *arg)
+{
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_expire = 0;
+	co->co_cpu = NULL;
+	co->co_func = func;
+	co->co_arg = arg;
+}
+
+void
+callout_schedule(struct callout *co, unsigned ticks)
+{
+	struct callout_wheel *w;
+	struct cpu *c;
+	uint64_t now;
+	int spl;
+
+	/* Stay on this cpu until the callout is on its wheel. */
+	spl = splhigh();
+
+	if (co->co_cpu != NULL) {
+		callout_stop(co);
+	}
+
+	c = curcpu->c_self;
+	w = &c->c_callouts;
+	now = callout_clock();
+
+	spinlock_acquire(&w->cw_lock);
+	if (w->cw_count == 0 && w->cw_running == NULL) {
+		/* Nothing to keep our place for. */
+		w->cw_now = now;
+	}
+	co->co_cpu = c;
+	co->co_expire = now + ticks;
+	callout_insert(w, co);
+	w->cw_count++;
+	spinlock_release(&w->cw_lock);
+
+	/*
+	 * If this cpu's tick is stretched or stopped, it might not
+	 * come around in time; go back to ticking every hardclock
+	 * and let the next one work out how long to wait.
+	 */
+	if (c->c_tickinterval == 0 || c->c_tickinterval > ticks) {
+		spinlock_acquire(&c->c_runqueue_lock);
+		hardclock_resume();
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	splx(spl);
+}
+
+bool
+callout_stop(struct callout *co)
+{
+	struct callout_wheel *w;
+
+	if (co->co_cpu == NULL) {
+		/* Never scheduled. */
+		return false;
+	}
+	w = &co->co_cpu->c_callouts;
+
+	spinlock_acquire(&w->cw_lock);
+	if (co->co_prevp != NULL) {
+		callout_unlink(co);
+		KASSERT(w->cw_count > 0);
+		w->cw_count--;
+		spinlock_release(&w->cw_lock);
+		return true;
+	}
+	spinlock_release(&w->cw_lock);
+
+	/*
+	 * Not pending. If it's being run on another cpu right now,
+	 * wait for that to finish. (On this cpu, we must be the
+	 * callout function itself, or have interrupted it... which
+	 * can't happen, since callouts run with interrupts off.)
+	 */
+	if (co->co_cpu != curcpu->c_self) {
+		while (w->cw_running == co) {
+			/* spin */
+		}
+	}
+	return false;
+}
+
+/*
+ * Run everything that has come due on this cpu's wheel.
+ */
+void
+callout_hardclock(void)
+{
+	struct callout_wheel *w = &curcpu->c_callouts;
+	struct callout *co;
+	uint64_t now;
+	unsigned level, slot;
+
+	spinlock_acquire(&w->cw_lock);
+	if (w->cw_count == 0) {
+		spinlock_release(&w->cw_lock);
+		return;
+	}
+
+	now = callout_clock();
+	while (w->cw_count > 0 && w->cw_now <= now) {
+		/* Cascade levels whose current slot we've reached. */
+		for (level = 1; level < CALLOUT_LEVELS; level++) {
+			if ((w->cw_now &
+			     ((1ULL << (CALLOUT_SLOTBITS * level)) - 1)) != 0) {
+				break;
+			}
+			slot = (w->cw_now >> (CALLOUT_SLOTBITS * level)) &
+				(CALLOUT_SLOTS - 1);
+			callout_cascade(w, level, slot);
+		}
+
+		/* Everything left in this level 0 slot is due now. */
+		slot = w->cw_now & (CALLOUT_SLOTS - 1);
+		while ((co = w->cw_slots[0][slot]) != NULL) {
+			KASSERT(co->co_expire == w->cw_now);
+			callout_unlink(co);
+			w->cw_count--;
+			w->cw_running = co;
+			spinlock_release(&w->cw_lock);
+
+			co->co_func(co->co_arg);
+
+			spinlock_acquire(&w->cw_lock);
+			w->cw_running = NULL;
+		}
+		w->cw_now++;
+	}
+	spinlock_release(&w->cw_lock);
+}
+
+/*
+ * Figure out how many ticks we can go without a hardclock and not
+ * miss anything. We only look through level 0; if nothing's there,
+ * the answer is when level 0 next wraps and the upper levels
+ * cascade into it.
+ */
+unsigned
+callout_nextevent(void)
+{
+	struct callout_wheel *w = &curcpu->c_callouts;
+	uint64_t now, when;
+
+	spinlock_acquire(&w->cw_lock);
+	if (w->cw_count == 0) {
+		spinlock_release(&w->cw_lock);
+		return 0;
+	}
+
+	when = w->cw_now;
+	do {
+		if (w->cw_slots[0][when & (CALLOUT_SLOTS - 1)] != NULL) {
+			break;
+		}
+		when++;
+	} while ((when & (CALLOUT_SLOTS - 1)) != 0);
+	spinlock_release(&w->cw_lock);
+
+	now = callout_clock();
+	if (when <= now) {
+		return 1;
+	}
+	return when - now;
+}
@@ -30,17 +30,22 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
+#include <threadlist.h>
+#include <mainbus.h>
 #include <wchan.h>
 #include <clock.h>
+#include <callout.h>
 #include <thread.h>
 #include <current.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Callbacks at specific points in the future, at hardclock
+ * resolution, are provided by callouts (see callout.c), which run
+ * from hardclock. clocksleep and the timed waits in synch.c are built
+ * on them.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -51,12 +56,13 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define MAX_STRETCH_HARDCLOCKS	HZ	/* Longest tick with one thread. */
+#define IDLE_STEAL_HARDCLOCKS	4	/* Idle tick while work is queued. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Threads in clocksleep wait here until their callout wakes them.
  */
-static struct wchan *lbolt;
+static struct wchan *sleepchan;
 
 /*
  * Setup.
@@ -64,42 +70,191 @@ static struct wchan *lbolt;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	sleepchan = wchan_create("clocksleep");
+	if (sleepchan == NULL) {
+		panic("Couldn't create clocksleep channel\n");
 	}
 }
 
 /*
  * This is called once per second, on one processor, by the timer
- * code.
+ * code. Nothing needs it any more; everything that used to wait for
+ * it uses callouts.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	wchan_wakeall(lbolt);
 }
 
 /*
- * This is called HZ times a second (on each processor) by the timer
- * code.
+ * Tickless operation.
+ *
+ * A cpu with an empty run queue has nothing to gain from being
+ * interrupted every tick. If it's idle, its timer is switched off
+ * until its next callout is due; if it's running a single thread,
+ * the tick is stretched out to the next callout, or at most to
+ * MAX_STRETCH_HARDCLOCKS, which is as long as we're willing to go
+ * without charging that thread for its cpu time.
+ *
+ * The exception is an idle cpu while other cpus have threads
+ * waiting. thread_steal only try-locks the other run queues, so it
+ * can come away empty-handed, and nothing else would tell us to try
+ * again; so such a cpu keeps ticking every IDLE_STEAL_HARDCLOCKS
+ * until the surplus is gone. (Work that shows up while we're idle
+ * with the timer off comes to us directly, since thread_place
+ * prefers idle cpus and sends IPI_UNIDLE.)
+ *
+ * A stretched tick is charged in full when it ends (see hardclock).
+ * If it's cut short by hardclock_resume, the part that has gone by
+ * is carried over and charged at the next hardclock instead, so it
+ * isn't lost. That's measured from c_tickstart, which is set only
+ * while running a thread: time spent idle isn't charged to anyone.
+ *
+ * c_tickinterval records the choice. It's only written by its own
+ * cpu, but it's written under the run queue lock so that
+ * thread_make_runnable, which holds the same lock, either sees the
+ * stretched tick and sends IPI_UNIDLE, or puts the thread on the
+ * queue before we look at it here.
+ */
+static
+void
+hardclock_rearm(void)
+{
+	struct cpu *c = curcpu->c_self;
+	unsigned ticks, next;
+
+	next = callout_nextevent();
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	if (c->c_isidle) {
+		ticks = next;
+		if (thread_work_elsewhere() &&
+		    (next == 0 || next > IDLE_STEAL_HARDCLOCKS)) {
+			ticks = IDLE_STEAL_HARDCLOCKS;
+		}
+	}
+	else if (threadlist_isempty(&c->c_runqueue)) {
+		ticks = MAX_STRETCH_HARDCLOCKS;
+		if (next != 0 && next < ticks) {
+			ticks = next;
+		}
+	}
+	else {
+		ticks = 1;
+	}
+	c->c_tickinterval = ticks;
+	c->c_tickstart = 0;
+	if (ticks > 1 && !c->c_isidle) {
+		c->c_tickstart = callout_clock();
+	}
+	spinlock_release(&c->c_runqueue_lock);
+
+	mainbus_settimer(ticks);
+}
+
+/*
+ * Go back to ticking every hardclock. Called with the run queue
+ * locked, when a cpu stops idling or is handed work, by another cpu
+ * (via IPI_UNIDLE) or by thread_make_runnable on this one.
+ * If a busy stretch is being cut short, the ticks it has run so far
+ * are left for the next hardclock to charge. (Not more than the
+ * stretch was for: if its interrupt is already due, that hardclock
+ * adds the last one.)
+ */
+void
+hardclock_resume(void)
+{
+	struct cpu *c = curcpu->c_self;
+	uint64_t elapsed;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_tickinterval != 1) {
+		if (c->c_tickstart != 0 && !c->c_isidle) {
+			elapsed = callout_clock() - c->c_tickstart;
+			if (elapsed >= c->c_tickinterval) {
+				elapsed = c->c_tickinterval - 1;
+			}
+			c->c_tickcarry += elapsed;
+		}
+		c->c_tickstart = 0;
+		c->c_tickinterval = 1;
+		mainbus_settimer(1);
+	}
+}
+
+/*
+ * This is called by the timer code HZ times a second on each
+ * processor, or less often on processors that are running tickless
+ * (see above).
  */
 void
 hardclock(void)
 {
+	unsigned ticks, i;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
-		schedule();
+	/*
+	 * Catch up on the ticks we skipped, including any left over
+	 * from a stretch that hardclock_resume cut short. If the timer
+	 * was off, we were idle and don't care how long it's been.
+	 */
+	ticks = curcpu->c_tickinterval;
+	if (ticks == 0) {
+		ticks = 1;
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	ticks += curcpu->c_tickcarry;
+	curcpu->c_tickcarry = 0;
+	for (i=0; i<ticks; i++) {
+		curcpu->c_hardclocks++;
+		if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+			schedule();
+		}
+	}
+
+	callout_hardclock();
+	hardclock_rearm();
+
+	if (thread_hardclock(ticks)) {
+		thread_yield();
 	}
-	thread_yield();
+}
+
+/*
+ * Callout function for clocksleep.
+ */
+static
+void
+clocksleep_wakeup(void *vthread)
+{
+	struct thread *t = vthread;
+
+	wchan_wakethread(sleepchan, t);
+}
+
+/*
+ * Suspend execution for n hardclock ticks.
+ */
+void
+clocksleep_ticks(unsigned ticks)
+{
+	struct callout co;
+
+	callout_init(&co, clocksleep_wakeup, curthread);
+
+	/*
+	 * Lock the channel first, so the callout can't go off before
+	 * we're on it.
+	 */
+	wchan_lock(sleepchan);
+	callout_schedule(&co, ticks);
+	wchan_sleep(sleepchan);
+
+	/* In case the callout function hasn't quite finished with CO */
+	callout_stop(&co);
 }
 
 /*
@@ -108,9 +263,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	while (num_secs > 0) {
-		wchan_lock(lbolt);
-		wchan_sleep(lbolt);
-		num_secs--;
+	if (num_secs > 0) {
+		clocksleep_ticks((unsigned)num_secs * HZ);
 	}
 }
@@ -0,0 +1,216 @@
+/*
+ * Interrupt-off latency tracer. See irqtrace.h.
+ *
+ * This is called from inside splraise and spinlock_acquire, so it
+ * can't use spinlocks, or anything that does. It doesn't need to:
+ * each cpu only writes its own records, and always at IPL_HIGH, so
+ * nothing else runs on that cpu meanwhile. The menu code reads the
+ * other cpus' records without stopping them, so a report taken while
+ * collecting may catch a record halfway through being updated.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <irqtrace.h>
+
+struct irqtrace_rec {
+	uint64_t ir_ns;			/* Length of the interval */
+	const void *ir_site;		/* Who started it */
+};
+
+struct irqtrace_cpu {
+	uint64_t ic_start;		/* Open interval start, or 0 */
+	const void *ic_site;		/* ...and who started it */
+	volatile bool ic_wantreset;	/* Set by irqtrace_reset */
+	struct irqtrace_rec ic_spl[IRQTRACE_WORST];	/* Longest first */
+	struct irqtrace_rec ic_spin[IRQTRACE_WORST];	/* Longest first */
+};
+
+volatile bool irqtrace_enabled;
+
+static struct irqtrace_cpu irqtrace_cpus[MAXCPUS];
+
+static
+uint64_t
+irqtrace_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Get the current cpu's records, clearing them first if a reset has
+ * been asked for.
+ */
+static
+struct irqtrace_cpu *
+irqtrace_mine(void)
+{
+	struct irqtrace_cpu *ic;
+
+	KASSERT(curcpu->c_number < MAXCPUS);
+	ic = &irqtrace_cpus[curcpu->c_number];
+	if (ic->ic_wantreset) {
+		bzero(ic->ic_spl, sizeof(ic->ic_spl));
+		bzero(ic->ic_spin, sizeof(ic->ic_spin));
+		ic->ic_wantreset = false;
+	}
+	return ic;
+}
+
+/*
+ * Keep NS if it's among the longest in RECS.
+ */
+static
+void
+irqtrace_note(struct irqtrace_rec *recs, uint64_t ns, const void *site)
+{
+	unsigned i;
+
+	if (ns <= recs[IRQTRACE_WORST-1].ir_ns) {
+		return;
+	}
+	for (i=IRQTRACE_WORST-1; i>0 && recs[i-1].ir_ns < ns; i--) {
+		recs[i] = recs[i-1];
+	}
+	recs[i].ir_ns = ns;
+	recs[i].ir_site = site;
+}
+
+void
+irqtrace_off(void)
+{
+	struct irqtrace_cpu *ic;
+	uint64_t now;
+
+	if (!irqtrace_enabled) {
+		return;
+	}
+
+	/*
+	 * Read the clock first: gettime raises the level again itself,
+	 * which must not be taken for the site of this interval.
+	 */
+	now = irqtrace_now();
+	ic = irqtrace_mine();
+	ic->ic_site = NULL;
+	ic->ic_start = now;
+}
+
+void
+irqtrace_site(const void *site)
+{
+	struct irqtrace_cpu *ic;
+
+	if (!irqtrace_enabled || !CURCPU_EXISTS()) {
+		return;
+	}
+	ic = irqtrace_mine();
+	if (ic->ic_start != 0 && ic->ic_site == NULL) {
+		ic->ic_site = site;
+	}
+}
+
+void
+irqtrace_on(void)
+{
+	struct irqtrace_cpu *ic;
+	uint64_t now;
+
+	ic = &irqtrace_cpus[curcpu->c_number];
+	if (ic->ic_start == 0) {
+		/* Started before collection was turned on */
+		return;
+	}
+	if (irqtrace_enabled) {
+		now = irqtrace_now();
+		ic = irqtrace_mine();
+		irqtrace_note(ic->ic_spl, now - ic->ic_start, ic->ic_site);
+	}
+	ic->ic_start = 0;
+}
+
+void
+irqtrace_spinacquire(struct spinlock_node *node, const void *site)
+{
+	if (!irqtrace_enabled || !CURCPU_EXISTS()) {
+		node->sn_stamp = 0;
+		return;
+	}
+	node->sn_site = site;
+	node->sn_stamp = irqtrace_now();
+}
+
+void
+irqtrace_spinrelease(struct spinlock_node *node)
+{
+	struct irqtrace_cpu *ic;
+	uint64_t now;
+
+	if (node->sn_stamp == 0) {
+		return;
+	}
+	if (irqtrace_enabled) {
+		now = irqtrace_now();
+		ic = irqtrace_mine();
+		irqtrace_note(ic->ic_spin, now - node->sn_stamp, node->sn_site);
+	}
+	node->sn_stamp = 0;
+}
+
+/*
+ * Throw away the records. Each cpu clears its own the next time it
+ * records something, so this doesn't race with them.
+ */
+void
+irqtrace_reset(void)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		irqtrace_cpus[i].ic_wantreset = true;
+	}
+}
+
+/*
+ * Print each cpu's longest intervals, side by side.
+ */
+void
+irqtrace_report(void)
+{
+	struct irqtrace_cpu *ic;
+	struct irqtrace_rec spl[IRQTRACE_WORST], spin[IRQTRACE_WORST];
+	unsigned i, j;
+
+	kprintf("irqtrace: %s\n", irqtrace_enabled ? "on" : "off");
+	for (i=0; i<MAXCPUS; i++) {
+		ic = &irqtrace_cpus[i];
+		if (ic->ic_wantreset) {
+			continue;
+		}
+		memcpy(spl, ic->ic_spl, sizeof(spl));
+		memcpy(spin, ic->ic_spin, sizeof(spin));
+		if (spl[0].ir_ns == 0 && spin[0].ir_ns == 0) {
+			continue;
+		}
+
+		kprintf("cpu%-2u %12s %-12s %12s %-12s\n", i,
+			"irqoff(ns)", "raised at", "spin(ns)", "taken at");
+		for (j=0; j<IRQTRACE_WORST; j++) {
+			if (spl[j].ir_ns == 0 && spin[j].ir_ns == 0) {
+				break;
+			}
+			kprintf("      %12llu %-12p %12llu %-12p\n",
+				spl[j].ir_ns, spl[j].ir_site,
+				spin[j].ir_ns, spin[j].ir_site);
+		}
+	}
+}
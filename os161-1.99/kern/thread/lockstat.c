@@ -0,0 +1,340 @@
+/*
+ * Lock contention statistics. See lockstat.h.
+ *
+ * This code is called from inside spinlock_acquire, so it can't use
+ * spinlocks (or kmalloc, which uses them) itself. Records come out
+ * of a fixed table and are protected by a bare test-and-set word
+ * with interrupts off.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockstat.h>
+
+#define LOCKSTAT_MAXRECORDS	512
+#define LOCKSTAT_HASHSIZE	128
+#define LOCKSTAT_NAMELEN	24
+#define LOCKSTAT_REPORTLINES	25
+
+struct lockstat {
+	struct lockstat *ls_next;	/* hash chain */
+	unsigned ls_kind;
+	const void *ls_site;		/* for spinlocks */
+	char ls_name[LOCKSTAT_NAMELEN];	/* for everything else */
+
+	uint64_t ls_acquired;		/* acquisitions */
+	uint64_t ls_contended;		/* ...that had to wait */
+	uint64_t ls_spins;		/* trips around spin loops */
+	uint64_t ls_sleepns;		/* time asleep waiting */
+	uint64_t ls_holdns;		/* time held */
+	uint64_t ls_maxholdns;		/* longest time held */
+};
+
+volatile bool lockstat_enabled;
+
+static struct lockstat lockstat_table[LOCKSTAT_MAXRECORDS];
+static struct lockstat *lockstat_hash[LOCKSTAT_HASHSIZE];
+static unsigned lockstat_count;
+static bool lockstat_full;
+static volatile spinlock_data_t lockstat_word = SPINLOCK_DATA_INITIALIZER;
+
+static
+int
+lockstat_lock(void)
+{
+	int spl;
+
+	spl = splhigh();
+	while (spinlock_data_get(&lockstat_word) != 0 ||
+	       spinlock_data_testandset(&lockstat_word) != 0) {
+		/* spin */
+	}
+	return spl;
+}
+
+static
+void
+lockstat_unlock(int spl)
+{
+	spinlock_data_set(&lockstat_word, 0);
+	splx(spl);
+}
+
+static
+unsigned
+lockstat_hashname(const char *name)
+{
+	unsigned h = 0;
+
+	while (*name != 0) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h % LOCKSTAT_HASHSIZE;
+}
+
+/*
+ * Names are kept truncated to LOCKSTAT_NAMELEN-1 characters, and
+ * compared that way too.
+ */
+static
+bool
+lockstat_samename(const char *ours, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1; i++) {
+		if (ours[i] != name[i]) {
+			return false;
+		}
+		if (ours[i] == 0) {
+			break;
+		}
+	}
+	return true;
+}
+
+static
+void
+lockstat_setname(char *ours, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != 0; i++) {
+		ours[i] = name[i];
+	}
+	ours[i] = 0;
+}
+
+/*
+ * Look up a record, adding it if needed. Returns NULL if the table's
+ * full. Table locked.
+ */
+static
+struct lockstat *
+lockstat_find(unsigned kind, const void *site, const char *name)
+{
+	struct lockstat *ls;
+	unsigned h;
+
+	if (name != NULL) {
+		h = lockstat_hashname(name);
+	}
+	else {
+		h = ((uintptr_t)site >> 2) % LOCKSTAT_HASHSIZE;
+	}
+
+	for (ls = lockstat_hash[h]; ls != NULL; ls = ls->ls_next) {
+		if (ls->ls_kind != kind) {
+			continue;
+		}
+		if (name == NULL ? ls->ls_site == site :
+		    lockstat_samename(ls->ls_name, name)) {
+			return ls;
+		}
+	}
+
+	if (lockstat_count == LOCKSTAT_MAXRECORDS) {
+		lockstat_full = true;
+		return NULL;
+	}
+	ls = &lockstat_table[lockstat_count++];
+	bzero(ls, sizeof(*ls));
+	ls->ls_kind = kind;
+	ls->ls_site = site;
+	if (name != NULL) {
+		lockstat_setname(ls->ls_name, name);
+	}
+	ls->ls_next = lockstat_hash[h];
+	lockstat_hash[h] = ls;
+	return ls;
+}
+
+struct lockstat *
+lockstat_site(unsigned kind, const void *site)
+{
+	struct lockstat *ls;
+	int spl;
+
+	if (!lockstat_enabled) {
+		return NULL;
+	}
+	spl = lockstat_lock();
+	ls = lockstat_find(kind, site, NULL);
+	lockstat_unlock(spl);
+	return ls;
+}
+
+struct lockstat *
+lockstat_named(struct lockstat **cache, unsigned kind, const char *name)
+{
+	struct lockstat *ls;
+	int spl;
+
+	if (!lockstat_enabled) {
+		return NULL;
+	}
+	if (*cache != NULL) {
+		return *cache;
+	}
+	spl = lockstat_lock();
+	ls = lockstat_find(kind, NULL, name);
+	lockstat_unlock(spl);
+	*cache = ls;
+	return ls;
+}
+
+uint64_t
+lockstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+void
+lockstat_acquire(struct lockstat *ls, bool contended, unsigned spins)
+{
+	int spl;
+
+	spl = lockstat_lock();
+	ls->ls_acquired++;
+	if (contended) {
+		ls->ls_contended++;
+	}
+	ls->ls_spins += spins;
+	lockstat_unlock(spl);
+}
+
+void
+lockstat_sleep(struct lockstat *ls, uint64_t since)
+{
+	uint64_t now;
+	int spl;
+
+	now = lockstat_now();
+	spl = lockstat_lock();
+	ls->ls_sleepns += now - since;
+	lockstat_unlock(spl);
+}
+
+void
+lockstat_hold(struct lockstat *ls, uint64_t since)
+{
+	uint64_t now, held;
+	int spl;
+
+	now = lockstat_now();
+	held = now - since;
+	spl = lockstat_lock();
+	ls->ls_holdns += held;
+	if (held > ls->ls_maxholdns) {
+		ls->ls_maxholdns = held;
+	}
+	lockstat_unlock(spl);
+}
+
+/*
+ * Zero the counters. The records themselves stay, since locks have
+ * pointers to them.
+ */
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+	int spl;
+
+	spl = lockstat_lock();
+	for (i=0; i<lockstat_count; i++) {
+		ls = &lockstat_table[i];
+		ls->ls_acquired = 0;
+		ls->ls_contended = 0;
+		ls->ls_spins = 0;
+		ls->ls_sleepns = 0;
+		ls->ls_holdns = 0;
+		ls->ls_maxholdns = 0;
+	}
+	lockstat_unlock(spl);
+}
+
+static
+uint64_t
+lockstat_key(const struct lockstat *ls, char key)
+{
+	switch (key) {
+	    case 'a': return ls->ls_acquired;
+	    case 's': return ls->ls_spins;
+	    case 'w': return ls->ls_sleepns;
+	    case 'h': return ls->ls_holdns;
+	    case 'm': return ls->ls_maxholdns;
+	    default: return ls->ls_contended;
+	}
+}
+
+/*
+ * Print the busiest locks, sorted by SORTKEY, which is one of
+ * "acq", "cont", "spin", "wait", "hold" or "maxhold" (only the first
+ * letter counts); the default is "cont".
+ */
+void
+lockstat_report(const char *sortkey)
+{
+	static struct lockstat *sorted[LOCKSTAT_MAXRECORDS];
+	static const char *const kinds[] = { "spin", "lock", "sem", "cv" };
+	struct lockstat *ls;
+	unsigned i, j, n, lines;
+	uint64_t k;
+	char key;
+	int spl;
+
+	key = (sortkey != NULL) ? sortkey[0] : 'c';
+
+	/* Take a snapshot of the record list; the counters can drift. */
+	spl = lockstat_lock();
+	n = lockstat_count;
+	for (i=0; i<n; i++) {
+		sorted[i] = &lockstat_table[i];
+	}
+	lockstat_unlock(spl);
+
+	/* Insertion sort, largest first. */
+	for (i=1; i<n; i++) {
+		ls = sorted[i];
+		k = lockstat_key(ls, key);
+		for (j=i; j>0 && lockstat_key(sorted[j-1], key) < k; j--) {
+			sorted[j] = sorted[j-1];
+		}
+		sorted[j] = ls;
+	}
+
+	kprintf("lockstat: %s, %u locks%s\n",
+		lockstat_enabled ? "on" : "off", n,
+		lockstat_full ? " (table full, some not counted)" : "");
+	kprintf("%-4s %-24s %10s %10s %10s %10s %10s %8s\n", "kind", "lock",
+		"acquired", "contended", "spins", "wait(us)", "hold(us)",
+		"max(us)");
+	lines = 0;
+	for (i=0; i<n && lines<LOCKSTAT_REPORTLINES; i++) {
+		ls = sorted[i];
+		if (ls->ls_acquired == 0) {
+			/* Not used since the last reset */
+			continue;
+		}
+		lines++;
+		if (ls->ls_kind == LOCKSTAT_SPINLOCK) {
+			kprintf("%-4s %-24p ", kinds[ls->ls_kind], ls->ls_site);
+		}
+		else {
+			kprintf("%-4s %-24s ", kinds[ls->ls_kind], ls->ls_name);
+		}
+		kprintf("%10llu %10llu %10llu %10llu %10llu %8llu\n",
+			ls->ls_acquired, ls->ls_contended, ls->ls_spins,
+			ls->ls_sleepns / 1000, ls->ls_holdns / 1000,
+			ls->ls_maxholdns / 1000);
+	}
+}
@@ -0,0 +1,68 @@
+/*
+ * Sleep queues. See sleepq.h.
+ *
+ * The table is sized so that, with the handful of threads that are
+ * ever asleep on synchronization objects at once, keyed wakeups
+ * rarely have to step over a sleeper for some other object.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <wchan.h>
+#include <sleepq.h>
+
+#define SLEEPQ_SIZE	64	/* must be a power of 2 */
+
+static struct wchan *sleepq_table[SLEEPQ_SIZE];
+
+void
+sleepq_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<SLEEPQ_SIZE; i++) {
+		sleepq_table[i] = wchan_create("sleepq");
+		if (sleepq_table[i] == NULL) {
+			panic("sleepq_bootstrap: out of memory\n");
+		}
+	}
+}
+
+struct wchan *
+sleepq_get(const void *obj)
+{
+	uintptr_t h;
+	struct wchan *wc;
+
+	/* Objects are at least word aligned and usually bigger. */
+	h = (uintptr_t)obj >> 3;
+	h ^= h >> 6;
+	wc = sleepq_table[h & (SLEEPQ_SIZE - 1)];
+	KASSERT(wc != NULL);
+	return wc;
+}
+
+void
+sleepq_lock2(struct wchan *a, struct wchan *b)
+{
+	if (a == b) {
+		wchan_lock(a);
+	}
+	else if ((uintptr_t)a < (uintptr_t)b) {
+		wchan_lock(a);
+		wchan_lock(b);
+	}
+	else {
+		wchan_lock(b);
+		wchan_lock(a);
+	}
+}
+
+void
+sleepq_unlock2(struct wchan *a, struct wchan *b)
+{
+	wchan_unlock(a);
+	if (a != b) {
+		wchan_unlock(b);
+	}
+}
@@ -35,12 +35,67 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
 
 /*
  * Spinlocks.
+ *
+ * These are MCS queue locks. Each cpu that wants the lock brings a
+ * queue entry (a struct spinlock_node), swaps it into lk_tail, and
+ * links it behind whoever was there before; then it spins on its own
+ * entry's sn_wait until the previous holder clears it on the way out.
+ * So the lock goes to cpus in the order they asked for it, and while
+ * they wait each cpu only reads its own entry, rather than all of
+ * them hammering the same lock word.
+ *
+ * A cpu's entries are in its struct cpu; until there is one, the boot
+ * cpu (the only one running then) uses spinlock_bootnodes.
  */
 
+static struct spinlock_node spinlock_bootnodes[SPINLOCK_MAXHELD];
+
+/*
+ * Set up a cpu's queue entries.
+ */
+void
+spinlock_nodes_init(struct spinlock_node *nodes)
+{
+	unsigned i;
+
+	for (i=0; i<SPINLOCK_MAXHELD; i++) {
+		nodes[i].sn_next = NULL;
+		nodes[i].sn_wait = false;
+		nodes[i].sn_inuse = false;
+#if OPT_IRQTRACE
+		nodes[i].sn_stamp = 0;
+#endif
+	}
+}
+
+/*
+ * Get a free queue entry for the current cpu. Interrupts must be off,
+ * which is what makes this safe without locking.
+ */
+static
+struct spinlock_node *
+spinlock_getnode(void)
+{
+	struct spinlock_node *nodes;
+	unsigned i;
+
+	nodes = CURCPU_EXISTS() ? curcpu->c_spinnodes : spinlock_bootnodes;
+	for (i=0; i<SPINLOCK_MAXHELD; i++) {
+		if (!nodes[i].sn_inuse) {
+			nodes[i].sn_inuse = true;
+			nodes[i].sn_next = NULL;
+			nodes[i].sn_wait = true;
+			return &nodes[i];
+		}
+	}
+	panic("Too many spinlocks held\n");
+	return NULL;
+}
 
 /*
  * Initialize spinlock.
@@ -48,8 +103,13 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	lk->lk_tail = NULL;
+	lk->lk_node = NULL;
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lk->lk_stat = NULL;
+	lk->lk_stamp = 0;
+#endif
 }
 
 /*
@@ -59,20 +119,41 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(lk->lk_tail == NULL);
 }
 
+/*
+ * With lockstat, note which call site got the lock and when, so
+ * spinlock_release can charge the hold time to it.
+ */
+#if OPT_LOCKSTAT
+static
+void
+spinlock_stat(struct spinlock *lk, const void *site, unsigned spins)
+{
+	lk->lk_stat = lockstat_site(LOCKSTAT_SPINLOCK, site);
+	if (lk->lk_stat != NULL) {
+		lockstat_acquire(lk->lk_stat, spins > 0, spins);
+		lk->lk_stamp = lockstat_now();
+	}
+}
+#endif
+
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then get in line and
+ * wait for the lock to be passed to us.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	struct spinlock_node *node, *pred;
+#if OPT_LOCKSTAT
+	unsigned spins = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,42 +168,115 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+	node = spinlock_getnode();
+	pred = atomic_swapptr((void *volatile *)&lk->lk_tail, node);
+	if (pred != NULL) {
+		/* Somebody has it; queue up behind the last in line. */
+		pred->sn_next = node;
+		while (node->sn_wait) {
+#if OPT_LOCKSTAT
+			spins++;
+#endif
 		}
-		break;
 	}
 
+	lk->lk_node = node;
+	lk->lk_holder = mycpu;
+#if OPT_LOCKSTAT
+	spinlock_stat(lk, __builtin_return_address(0), spins);
+#endif
+#if OPT_IRQTRACE
+	irqtrace_site(__builtin_return_address(0));
+	irqtrace_spinacquire(node, __builtin_return_address(0));
+#endif
+}
+
+/*
+ * Try to get the lock without waiting for it. Used where spinning
+ * on somebody else's lock isn't worth it, or could deadlock against
+ * a cpu doing the same thing to us.
+ */
+bool
+spinlock_tryacquire(struct spinlock *lk)
+{
+	struct cpu *mycpu;
+	struct spinlock_node *node;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		KASSERT(lk->lk_holder != mycpu);
+	}
+	else {
+		mycpu = NULL;
+	}
+
+	/* Only if there's no line at all. */
+	if (lk->lk_tail != NULL) {
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
+	}
+	node = spinlock_getnode();
+	if (atomic_casptr((void *volatile *)&lk->lk_tail, NULL, node) != NULL) {
+		node->sn_inuse = false;
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
+	}
+
+	lk->lk_node = node;
 	lk->lk_holder = mycpu;
+#if OPT_LOCKSTAT
+	spinlock_stat(lk, __builtin_return_address(0), 0);
+#endif
+#if OPT_IRQTRACE
+	irqtrace_site(__builtin_return_address(0));
+	irqtrace_spinacquire(node, __builtin_return_address(0));
+#endif
+	return true;
 }
 
 /*
- * Release the lock.
+ * Release the lock: hand it to the next cpu in line, if any.
  */
 void
 spinlock_release(struct spinlock *lk)
 {
+	struct spinlock_node *node;
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	if (lk->lk_stat != NULL) {
+		lockstat_hold(lk->lk_stat, lk->lk_stamp);
+		lk->lk_stat = NULL;
+	}
+#endif
+	node = lk->lk_node;
+	lk->lk_node = NULL;
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+#if OPT_IRQTRACE
+	irqtrace_spinrelease(node);
+#endif
+
+	if (node->sn_next == NULL) {
+		/* Nobody in line, unless someone's just joining it. */
+		if (atomic_casptr((void *volatile *)&lk->lk_tail,
+				  node, NULL) == node) {
+			node->sn_inuse = false;
+			spllower(IPL_HIGH, IPL_NONE);
+			return;
+		}
+		while (node->sn_next == NULL) {
+			/* wait for them to link in behind us */
+		}
+	}
+	node->sn_next->sn_wait = false;
+	node->sn_inuse = false;
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
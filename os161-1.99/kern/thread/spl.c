@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <irqtrace.h>
 
 /*
  * Machine-independent interrupt handling functions.
@@ -78,10 +79,32 @@
  *
  * In order to make this work we need to count the number of times
  * IPL_HIGH (or, if we had multiple interrupt priority levels, each
- * level independently) has been raised. Interrupts go off on the
+ * level independently) has been raised. Interrupts are off from the
  * first raise, and go on again only on the last lower.
  *
  * curthread->t_iplhigh_count is used to track this.
+ *
+ * Turning interrupts off is lazy: raising the level only counts, and
+ * doesn't touch the processor. Interrupts almost never arrive during
+ * the short stretches spent at IPL_HIGH, mostly holding spinlocks,
+ * and writing the status register on every acquire and release costs
+ * more than dealing with the ones that do. If one does arrive, the
+ * trap code sees t_iplhigh_count and, instead of handling it, turns
+ * interrupts off for real and returns (see mips_trap). The device
+ * keeps asserting the interrupt, so when the level drops back to
+ * IPL_NONE and interrupts go on again, it's taken then.
+ *
+ * curcpu->c_irqoff says interrupts may be off in the processor and
+ * need to be turned on when the level drops to IPL_NONE. It's set
+ * whenever they're turned off underneath code that may later lower
+ * the level: when an interrupt is put off, and on entry to the trap
+ * handler and to the idle loop. It's per-cpu, not per-thread,
+ * because a thread switch at IPL_HIGH carries the processor's state
+ * over to the next thread.
+ *
+ * With options irqtrace, the raise off IPL_NONE and the lower back
+ * to it are where each interrupt-off interval starts and ends; splx
+ * and spinlock_acquire then say who to blame (see irqtrace.h).
  */
 void
 splraise(int oldspl, int newspl)
@@ -97,10 +120,12 @@ splraise(int oldspl, int newspl)
 		return;
 	}
 
-	if (cur->t_iplhigh_count == 0) {
-		cpu_irqoff();
-	}
 	cur->t_iplhigh_count++;
+#if OPT_IRQTRACE
+	if (cur->t_iplhigh_count == 1) {
+		irqtrace_off();
+	}
+#endif
 }
 
 void
@@ -117,8 +142,14 @@ spllower(int oldspl, int newspl)
 		return;
 	}
 
+#if OPT_IRQTRACE
+	if (cur->t_iplhigh_count == 1) {
+		irqtrace_on();
+	}
+#endif
 	cur->t_iplhigh_count--;
-	if (cur->t_iplhigh_count == 0) {
+	if (cur->t_iplhigh_count == 0 && curcpu->c_irqoff) {
+		curcpu->c_irqoff = false;
 		cpu_irqon();
 	}
 }
@@ -139,6 +170,9 @@ splx(int spl)
 		splraise(cur->t_curspl, spl);
 		ret = cur->t_curspl;
 		cur->t_curspl = spl;
+#if OPT_IRQTRACE
+		irqtrace_site(__builtin_return_address(0));
+#endif
 	}
 	else if (cur->t_curspl > spl) {
 		/* turning interrupts on */
@@ -33,21 +33,71 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <callout.h>
+#include <atomic.h>
+#include <lockstat.h>
+#include <sleepq.h>
 #include <synch.h>
 
+////////////////////////////////////////////////////////////
+//
+// Timeouts.
+//
+// A timed wait schedules a callout that pulls the sleeping thread
+// back off the sleep queue if nobody has woken it by then. The
+// callout is scheduled with the queue locked, which keeps it from
+// firing (on this cpu, with interrupts off) before we're asleep.
+
+struct timedwait {
+	struct wchan *tw_wchan;
+	struct thread *tw_thread;
+	volatile bool tw_expired;
+};
+
+static
+void
+timedwait_expire(void *vtw)
+{
+	struct timedwait *tw = vtw;
+
+	tw->tw_expired = true;
+	wchan_wakethread(tw->tw_wchan, tw->tw_thread);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+void
+sem_init(struct semaphore *sem, const char *name, int initial_count)
+{
+        KASSERT(initial_count >= 0);
+
+        sem->sem_name = name;
+        sem->sem_count = initial_count;
+	sem->sem_nwaiters = 0;
+#if OPT_LOCKSTAT
+	sem->sem_stat = NULL;
+#endif
+}
+
+void
+sem_cleanup(struct semaphore *sem)
+{
+	KASSERT(sem->sem_nwaiters == 0);
+}
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
         struct semaphore *sem;
+	char *copy;
 
         KASSERT(initial_count >= 0);
 
@@ -56,22 +106,13 @@ sem_create(const char *name, int initial_count)
                 return NULL;
         }
 
-        sem->sem_name = kstrdup(name);
-        if (sem->sem_name == NULL) {
+        copy = kstrdup(name);
+        if (copy == NULL) {
                 kfree(sem);
                 return NULL;
         }
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
-        sem->sem_count = initial_count;
-
+	sem_init(sem, copy, initial_count);
         return sem;
 }
 
@@ -80,16 +121,51 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
-        kfree(sem->sem_name);
+	sem_cleanup(sem);
+        kfree((char *)sem->sem_name);
         kfree(sem);
 }
 
+/*
+ * The count is changed only with atomic_cas, so P with a nonzero
+ * count and V with nobody waiting never touch the sleep queue.
+ *
+ * A P that finds the count zero counts itself in sem_nwaiters, under
+ * the sleep queue lock, and tries again before going to sleep; V
+ * adds to the count first and looks at sem_nwaiters after, taking
+ * the queue lock to do the wakeup. As with locks (see lock_acquire)
+ * this relies on memory being sequentially consistent: either the
+ * sleeper sees V's count, or V sees the sleeper and wakes it, which
+ * can't happen until it's asleep.
+ */
+
+/*
+ * Take one from the count, unless it's zero. Returns true if we did.
+ */
+static
+bool
+sem_trydown(struct semaphore *sem)
+{
+	unsigned count;
+
+	do {
+		count = sem->sem_count;
+		if (count == 0) {
+			return false;
+		}
+	} while (atomic_cas(&sem->sem_count, count, count - 1) != count);
+	return true;
+}
+
 void 
 P(struct semaphore *sem)
 {
+	struct wchan *sq;
+#if OPT_LOCKSTAT
+	struct lockstat *ls;
+	uint64_t since = 0;
+#endif
+
         KASSERT(sem != NULL);
 
         /*
@@ -100,14 +176,28 @@ P(struct semaphore *sem)
          */
         KASSERT(curthread->t_in_interrupt == false);
 
-	spinlock_acquire(&sem->sem_lock);
-        while (sem->sem_count == 0) {
+#if OPT_LOCKSTAT
+	ls = lockstat_named(&sem->sem_stat, LOCKSTAT_SEM, sem->sem_name);
+#endif
+	if (sem_trydown(sem)) {
+#if OPT_LOCKSTAT
+		if (ls != NULL) {
+			lockstat_acquire(ls, false, 0);
+		}
+#endif
+		return;
+	}
+
+#if OPT_LOCKSTAT
+	if (ls != NULL) {
+		since = lockstat_now();
+	}
+#endif
+	sq = sleepq_get(sem);
+	wchan_lock(sq);
+	sem->sem_nwaiters++;
+        while (!sem_trydown(sem)) {
 		/*
-		 * Bridge to the wchan lock, so if someone else comes
-		 * along in V right this instant the wakeup can't go
-		 * through on the wchan until we've finished going to
-		 * sleep. Note that wchan_sleep unlocks the wchan.
-		 *
 		 * Note that we don't maintain strict FIFO ordering of
 		 * threads going through the semaphore; that is, we
 		 * might "get" it on the first try even if other
@@ -118,60 +208,137 @@ P(struct semaphore *sem)
 		 * Exercise: how would you implement strict FIFO
 		 * ordering?
 		 */
-		wchan_lock(sem->sem_wchan);
-		spinlock_release(&sem->sem_lock);
-                wchan_sleep(sem->sem_wchan);
+                wchan_sleep_key(sq, sem);
+		wchan_lock(sq);
+        }
+	sem->sem_nwaiters--;
+	wchan_unlock(sq);
+
+#if OPT_LOCKSTAT
+	if (ls != NULL) {
+		lockstat_acquire(ls, true, 0);
+		lockstat_sleep(ls, since);
+	}
+#endif
+}
+
+int
+sem_timedwait(struct semaphore *sem, unsigned ticks)
+{
+	struct timedwait tw;
+	struct callout co;
+	struct wchan *sq;
+	bool armed;
+	int result;
+
+        KASSERT(sem != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	if (sem_trydown(sem)) {
+		return 0;
+	}
+
+	sq = sleepq_get(sem);
+	tw.tw_wchan = sq;
+	tw.tw_thread = curthread;
+	tw.tw_expired = false;
+	callout_init(&co, timedwait_expire, &tw);
+	armed = false;
+	result = 0;
 
-		spinlock_acquire(&sem->sem_lock);
+	wchan_lock(sq);
+	sem->sem_nwaiters++;
+        while (!sem_trydown(sem)) {
+		if (tw.tw_expired) {
+			result = ETIMEDOUT;
+			break;
+		}
+		if (!armed) {
+			callout_schedule(&co, ticks);
+			armed = true;
+		}
+                wchan_sleep_key(sq, sem);
+		wchan_lock(sq);
         }
-        KASSERT(sem->sem_count > 0);
-        sem->sem_count--;
-	spinlock_release(&sem->sem_lock);
+	sem->sem_nwaiters--;
+	wchan_unlock(sq);
+
+	if (armed) {
+		callout_stop(&co);
+	}
+	return result;
 }
 
 void
 V(struct semaphore *sem)
 {
-        KASSERT(sem != NULL);
+	struct wchan *sq;
+	unsigned count;
 
-	spinlock_acquire(&sem->sem_lock);
+        KASSERT(sem != NULL);
 
-        sem->sem_count++;
-        KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan);
+	do {
+		count = sem->sem_count;
+		KASSERT(count + 1 > 0);
+	} while (atomic_cas(&sem->sem_count, count, count + 1) != count);
 
-	spinlock_release(&sem->sem_lock);
+	if (sem->sem_nwaiters > 0) {
+		sq = sleepq_get(sem);
+		wchan_lock(sq);
+		wchan_wakeone_key(sq, sem);
+		wchan_unlock(sq);
+	}
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Lock.
 
+void
+lock_init(struct lock *lock, const char *name)
+{
+    unsigned i;
+
+    lock->lk_name = name;
+    lock->thread_ptr = NULL;
+    lock->lock_nwaiters = 0;
+    for (i=0; i<MLFQ_LEVELS; i++) {
+        lock->lock_pi_waiters[i] = 0;
+    }
+    lock->lock_pi_owner = NULL;
+    lock->lock_pi_next = NULL;
+#if OPT_LOCKSTAT
+    lock->lock_stat = NULL;
+    lock->lock_stamp = 0;
+#endif
+}
+
+void
+lock_cleanup(struct lock *lock)
+{
+    KASSERT(lock->thread_ptr == NULL);
+    KASSERT(lock->lock_nwaiters == 0);
+    KASSERT(lock->lock_pi_owner == NULL);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
+        char *copy;
 
         lock = kmalloc(sizeof(struct lock));
         if (lock == NULL) {
                 return NULL;
         }
 
-        lock->lk_name = kstrdup(name);
-        if (lock->lk_name == NULL) {
+        copy = kstrdup(name);
+        if (copy == NULL) {
                 kfree(lock);
                 return NULL;
         }
-        
-    lock->lock_wchan = wchan_create(lock->lk_name);
-    if (lock->lock_wchan == NULL) {
-        kfree(lock->lk_name);
-        kfree(lock);
-        return NULL;
-    }
-    spinlock_init(&lock->lock_lock);
-    lock->thread_ptr = NULL;
-    
+
+    lock_init(lock, copy);
         return lock;
 }
 
@@ -180,42 +347,379 @@ lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
 
-    lock->thread_ptr = NULL;
-    spinlock_cleanup(&lock->lock_lock);
-    wchan_destroy(lock->lock_wchan);
-        kfree(lock->lk_name);
+    lock_cleanup(lock);
+        kfree((char *)lock->lk_name);
         kfree(lock);
 }
 
+/*
+ * Priority inheritance.
+ *
+ * A thread that goes to sleep on a lock lends its scheduling level to
+ * the holder, which then runs at the best (lowest) level of anything
+ * waiting on any lock it holds, if that beats its own (see
+ * thread_level). If the holder is itself waiting for a lock, the loan
+ * is passed on to that lock's holder, and so on down the chain. When
+ * the holder lets go of a lock it keeps only what it's still owed
+ * through the locks it still holds.
+ *
+ * Each lock counts its waiters by the level they were counted at
+ * (lock_pi_waiters), and each thread has a list of the locks it holds
+ * that have waiters (t_pi_locks, linked through lock_pi_next), so a
+ * thread's inherited level is the best level found along its list.
+ * All of this is protected by pi_lock. Lock ordering is the lock's
+ * sleep queue, then pi_lock, then the run queue locks
+ * (thread_set_pi_level).
+ *
+ * Only sleepers lend their level; a thread that's spinning has seen
+ * the holder running, which is what lending would achieve anyway.
+ *
+ * The holder found in thread_ptr may be in the middle of releasing
+ * the lock. That's harmless: the lock has waiters, so the holder
+ * will come through pi_lock in lock_release before it's done, and
+ * drop whatever it inherited then. (Waiters stay in lock_nwaiters
+ * until after lock_pi_acquired, so lock_release can't miss them.)
+ */
+#define PI_MAXCHAIN	16	/* Longest chain we'll follow */
+
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
+volatile bool lock_pi_enabled = true;
+
+static void lock_pi_update(struct thread *t);
+
+/*
+ * Best level among LOCK's waiters, or MLFQ_LEVELS if none.
+ */
+static
+unsigned
+lock_pi_best(struct lock *lock)
+{
+    unsigned i;
+
+    for (i=0; i<MLFQ_LEVELS; i++) {
+        if (lock->lock_pi_waiters[i] > 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Take LOCK off its owner's list, and recompute the owner's level.
+ */
+static
+void
+lock_pi_detach(struct lock *lock)
+{
+    struct thread *owner;
+    struct lock **pp;
+
+    owner = lock->lock_pi_owner;
+    if (owner == NULL) {
+        return;
+    }
+    for (pp = &owner->t_pi_locks; *pp != lock; pp = &(*pp)->lock_pi_next) {
+        KASSERT(*pp != NULL);
+    }
+    *pp = lock->lock_pi_next;
+    lock->lock_pi_next = NULL;
+    lock->lock_pi_owner = NULL;
+    lock_pi_update(owner);
+}
+
+/*
+ * Put LOCK on T's list (taking it off anyone else's).
+ */
+static
+void
+lock_pi_attach(struct lock *lock, struct thread *t)
+{
+    if (lock->lock_pi_owner == t) {
+        return;
+    }
+    lock_pi_detach(lock);
+    lock->lock_pi_next = t->t_pi_locks;
+    t->t_pi_locks = lock;
+    lock->lock_pi_owner = t;
+}
+
+/*
+ * Recompute T's inherited level. If that changes the level T is
+ * waiting on a lock at, pass the change on to the lock's holder.
+ */
+static
+void
+lock_pi_update(struct thread *t)
+{
+    struct lock *lock;
+    unsigned pi, best, level, depth;
+
+    for (depth = 0; t != NULL && depth < PI_MAXCHAIN; depth++) {
+        pi = MLFQ_LEVELS;
+        for (lock = t->t_pi_locks; lock != NULL; lock = lock->lock_pi_next) {
+            best = lock_pi_best(lock);
+            if (best < pi) {
+                pi = best;
+            }
+        }
+        if (pi == t->t_pi_level) {
+            return;
+        }
+        thread_set_pi_level(t, pi);
+
+        lock = t->t_pi_blockedon;
+        if (lock == NULL) {
+            return;
+        }
+        level = thread_level(t);
+        if (level == t->t_pi_waitlevel) {
+            return;
+        }
+        lock->lock_pi_waiters[t->t_pi_waitlevel]--;
+        lock->lock_pi_waiters[level]++;
+        t->t_pi_waitlevel = level;
+
+        t = lock->thread_ptr;
+        if (t != NULL) {
+            lock_pi_attach(lock, t);
+        }
+    }
+}
+
+/*
+ * About to sleep on LOCK: count ourselves as a waiter, if we aren't
+ * already, and make sure the holder has our level.
+ */
+static
+void
+lock_pi_wait(struct lock *lock)
+{
+    struct thread *cur = curthread;
+    struct thread *owner;
+
+    spinlock_acquire(&pi_lock);
+    if (cur->t_pi_blockedon == NULL) {
+        cur->t_pi_blockedon = lock;
+        cur->t_pi_waitlevel = thread_level(cur);
+        lock->lock_pi_waiters[cur->t_pi_waitlevel]++;
+    }
+    KASSERT(cur->t_pi_blockedon == lock);
+    owner = lock->thread_ptr;
+    if (owner != NULL) {
+        lock_pi_attach(lock, owner);
+        lock_pi_update(owner);
+    }
+    spinlock_release(&pi_lock);
+}
+
+/*
+ * Just got LOCK while it had waiters: stop being counted as one, and
+ * take over whatever the remaining waiters were lending the previous
+ * holder.
+ */
+static
+void
+lock_pi_acquired(struct lock *lock)
+{
+    struct thread *cur = curthread;
+
+    spinlock_acquire(&pi_lock);
+    if (cur->t_pi_blockedon == lock) {
+        lock->lock_pi_waiters[cur->t_pi_waitlevel]--;
+        cur->t_pi_blockedon = NULL;
+    }
+    if (lock_pi_best(lock) < MLFQ_LEVELS) {
+        lock_pi_attach(lock, cur);
+    }
+    else {
+        lock_pi_detach(lock);
+    }
+    lock_pi_update(cur);
+    spinlock_release(&pi_lock);
+}
+
+/*
+ * Just let go of LOCK while it had waiters: give back what they lent.
+ */
+static
+void
+lock_pi_released(struct lock *lock)
+{
+    struct thread *cur = curthread;
+
+    spinlock_acquire(&pi_lock);
+    if (lock->lock_pi_owner == cur) {
+        lock_pi_detach(lock);
+    }
+    else {
+        lock_pi_update(cur);
+    }
+    spinlock_release(&pi_lock);
+}
+
+/*
+ * Adaptive locking.
+ *
+ * The owner is claimed by swapping curthread into thread_ptr with
+ * atomic_casptr, so an uncontended acquire or release never touches
+ * the sleep queue.
+ *
+ * If the lock is held, what to do depends on the holder. If it's
+ * running on some other cpu it will probably let go soon, and
+ * spinning is cheaper than two context switches, so we spin (up to
+ * LOCK_MAXSPIN times around, in case it isn't so quick). If it isn't
+ * running, it can't release the lock until it gets a cpu again, and
+ * we go to sleep.
+ *
+ * Sleepers count themselves in lock_nwaiters, under the sleep queue
+ * lock, and check the lock is still held after doing so and before
+ * sleeping; lock_release clears the owner first and looks at
+ * lock_nwaiters after. (This relies on memory being sequentially
+ * consistent, which it is on System/161.) So either the sleeper sees
+ * the lock free, or the releaser sees the sleeper and wakes it,
+ * taking the sleep queue lock first so the wakeup can't happen before
+ * the sleeper is asleep.
+ *
+ * The holder's t_state is read without any locking. The holder may
+ * release the lock and even exit while we look, but thread
+ * structures are pooled or freed to kernel memory that stays mapped,
+ * and all we do with a stale value is make a wrong guess whether to
+ * spin.
+ */
+#define LOCK_MAXSPIN	1000
+
+/*
+ * With lockstat, record how we got the lock (SINCE is when we went
+ * to sleep for it, or 0) and note when, for lock_release.
+ */
+#if OPT_LOCKSTAT
+static
+void
+lock_stat(struct lock *lock, bool contended, unsigned spins, uint64_t since)
+{
+    struct lockstat *ls;
+
+    ls = lockstat_named(&lock->lock_stat, LOCKSTAT_LOCK, lock->lk_name);
+    if (ls == NULL) {
+        lock->lock_stamp = 0;
+        return;
+    }
+    lockstat_acquire(ls, contended, spins);
+    if (since != 0) {
+        lockstat_sleep(ls, since);
+    }
+    lock->lock_stamp = lockstat_now();
+}
+#define LOCK_STAT(lock, contended, spins, since) \
+	lock_stat(lock, contended, spins, since)
+#else
+#define LOCK_STAT(lock, contended, spins, since)
+#endif
+
 void
 lock_acquire(struct lock *lock)
 {
+    struct thread *owner;
+    struct wchan *sq;
+    unsigned spins;
+#if OPT_LOCKSTAT
+    uint64_t since;
+#endif
+
     KASSERT(lock != NULL);
     KASSERT(curthread->t_in_interrupt == false);
-    spinlock_acquire(&lock->lock_lock);
-    while(lock->thread_ptr != NULL) {
-        wchan_lock(lock->lock_wchan);
-        spinlock_release(&lock->lock_lock);
-        wchan_sleep(lock->lock_wchan);
-        spinlock_acquire(&lock->lock_lock);
+
+    /* Fast path: lock is free. */
+    owner = atomic_casptr((void *volatile *)&lock->thread_ptr,
+                          NULL, curthread);
+    if (owner == NULL) {
+        if (lock->lock_nwaiters > 0) {
+            lock_pi_acquired(lock);
+        }
+        LOCK_STAT(lock, false, 0, 0);
+        return;
     }
-    KASSERT(lock->thread_ptr == NULL);
-    lock->thread_ptr = curthread;
-    spinlock_release(&lock->lock_lock);
+    KASSERT(owner != curthread);
+
+    /* Spin while the owner is running. */
+    for (spins = 0; spins < LOCK_MAXSPIN; spins++) {
+        owner = lock->thread_ptr;
+        if (owner == NULL) {
+            owner = atomic_casptr((void *volatile *)&lock->thread_ptr,
+                                  NULL, curthread);
+            if (owner == NULL) {
+                if (lock->lock_nwaiters > 0) {
+                    lock_pi_acquired(lock);
+                }
+                LOCK_STAT(lock, true, spins, 0);
+                return;
+            }
+        }
+        if (owner->t_state != S_RUN) {
+            break;
+        }
+    }
+
+    /* Sleep until we get it. */
+#if OPT_LOCKSTAT
+    since = lockstat_enabled ? lockstat_now() : 0;
+#endif
+    sq = sleepq_get(lock);
+    wchan_lock(sq);
+    lock->lock_nwaiters++;
+    while (atomic_casptr((void *volatile *)&lock->thread_ptr,
+                         NULL, curthread) != NULL) {
+        if (lock_pi_enabled) {
+            lock_pi_wait(lock);
+        }
+        wchan_sleep_key(sq, lock);
+        wchan_lock(sq);
+    }
+    /* Before we stop counting; see lock_release. */
+    lock_pi_acquired(lock);
+    lock->lock_nwaiters--;
+    wchan_unlock(sq);
+    LOCK_STAT(lock, true, spins, since);
 }
 
+/*
+ * Let go of LOCK. If SQ isn't NULL, it's the lock's sleep queue and
+ * the caller has it locked already (see cv_wait).
+ */
+static
 void
-lock_release(struct lock *lock)
+lock_release_sq(struct lock *lock, struct wchan *sq)
 {
+    bool locked;
+
     KASSERT(lock != NULL);
-    
-    spinlock_acquire(&lock->lock_lock);
     KASSERT(lock->thread_ptr == curthread);
+
+#if OPT_LOCKSTAT
+    if (lock->lock_stamp != 0) {
+        lockstat_hold(lock->lock_stat, lock->lock_stamp);
+        lock->lock_stamp = 0;
+    }
+#endif
     lock->thread_ptr = NULL;
-    KASSERT(lock->thread_ptr == NULL);
-    wchan_wakeone(lock->lock_wchan);
-    
-    spinlock_release(&lock->lock_lock);
+    if (lock->lock_nwaiters > 0) {
+        locked = (sq != NULL);
+        if (!locked) {
+            sq = sleepq_get(lock);
+            wchan_lock(sq);
+        }
+        lock_pi_released(lock);
+        wchan_wakeone_key(sq, lock);
+        if (!locked) {
+            wchan_unlock(sq);
+        }
+    }
+}
+
+void
+lock_release(struct lock *lock)
+{
+    lock_release_sq(lock, NULL);
 }
 
 bool
@@ -234,29 +738,40 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+void
+cv_init(struct cv *cv, const char *name)
+{
+    cv->cv_name = name;
+#if OPT_LOCKSTAT
+    cv->cv_stat = NULL;
+#endif
+}
+
+void
+cv_cleanup(struct cv *cv)
+{
+    /* As with semaphores, nobody can be waiting. */
+    (void)cv;
+}
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
+        char *copy;
 
         cv = kmalloc(sizeof(struct cv));
         if (cv == NULL) {
                 return NULL;
         }
 
-        cv->cv_name = kstrdup(name);
-        if (cv->cv_name==NULL) {
+        copy = kstrdup(name);
+        if (copy == NULL) {
                 kfree(cv);
                 return NULL;
         }
-        
-    cv->cv_wchan = wchan_create(cv->cv_name);
-    if(cv->cv_wchan==NULL) {
-        kfree(cv->cv_name);
-        kfree(cv);
-        return NULL;
-    }
-    
+
+    cv_init(cv, copy);
         return cv;
 }
 
@@ -264,32 +779,260 @@ void
 cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
-    wchan_destroy(cv->cv_wchan);
-    
-        
-        kfree(cv->cv_name);
+
+    cv_cleanup(cv);
+        kfree((char *)cv->cv_name);
         kfree(cv);
 }
 
+/*
+ * Lock the CV's sleep queue, and let go of LOCK, so a signal sent in
+ * between isn't lost. The lock's own queue has to be held while
+ * releasing it too, and may be a different one; sleepq_lock2 keeps
+ * that from deadlocking against another cv_wait that has them the
+ * other way around. Returns the CV's queue, still locked.
+ */
+static
+struct wchan *
+cv_release(struct cv *cv, struct lock *lock)
+{
+    struct wchan *cvq, *lockq;
+
+    KASSERT(lock_do_i_hold(lock));
+
+    cvq = sleepq_get(cv);
+    lockq = sleepq_get(lock);
+    sleepq_lock2(cvq, lockq);
+    lock_release_sq(lock, lockq);
+    if (lockq != cvq) {
+        wchan_unlock(lockq);
+    }
+    return cvq;
+}
+
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-    lock_release(lock);
-    wchan_lock(cv->cv_wchan);
-    wchan_sleep(cv->cv_wchan);
+    struct wchan *sq;
+#if OPT_LOCKSTAT
+    struct lockstat *ls;
+    uint64_t since = 0;
+
+    ls = lockstat_named(&cv->cv_stat, LOCKSTAT_CV, cv->cv_name);
+    if (ls != NULL) {
+        since = lockstat_now();
+    }
+#endif
+
+    sq = cv_release(cv, lock);
+    wchan_sleep_key(sq, cv);
+#if OPT_LOCKSTAT
+    if (ls != NULL) {
+        /* Every wait counts as contended. */
+        lockstat_acquire(ls, true, 0);
+        lockstat_sleep(ls, since);
+    }
+#endif
     lock_acquire(lock);
 }
 
+int
+cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+    struct timedwait tw;
+    struct callout co;
+    struct wchan *sq;
+
+    tw.tw_wchan = sleepq_get(cv);
+    tw.tw_thread = curthread;
+    tw.tw_expired = false;
+    callout_init(&co, timedwait_expire, &tw);
+
+    sq = cv_release(cv, lock);
+    callout_schedule(&co, ticks);
+    wchan_sleep_key(sq, cv);
+
+    /* Cancel it, or wait for it to finish with TW if it's running. */
+    callout_stop(&co);
+    lock_acquire(lock);
+    return tw.tw_expired ? ETIMEDOUT : 0;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-    wchan_wakeone(cv->cv_wchan);
-    (void) lock;
+    struct wchan *sq;
+
+    (void)lock;
+
+    sq = sleepq_get(cv);
+    wchan_lock(sq);
+    wchan_wakeone_key(sq, cv);
+    wchan_unlock(sq);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	wchan_wakeall(cv->cv_wchan);
-    (void) lock;
+    struct wchan *sq;
+
+    (void)lock;
+
+    sq = sleepq_get(cv);
+    wchan_lock(sq);
+    wchan_wakeall_key(sq, cv);
+    wchan_unlock(sq);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+//
+// Readers and writers sleep on separate wchans so that a release
+// wakes only the side that can make progress: when the last reader
+// leaves, one writer; when a writer leaves, the next writer if
+// writers are preferred and one is waiting, otherwise all readers.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writer = NULL;
+	rw->rw_waitreaders = 0;
+	rw->rw_waitwriters = 0;
+	rw->rw_readerbias = false;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+
+	/* wchan_cleanup will assert if anyone's waiting on it */
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_setreaderbias(struct rwlock *rw, bool readerbias)
+{
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_readerbias = readerbias;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL ||
+	       (!rw->rw_readerbias && rw->rw_waitwriters > 0)) {
+		rw->rw_waitreaders++;
+		wchan_lock(rw->rw_readwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_readwchan);
+		spinlock_acquire(&rw->rw_lock);
+		rw->rw_waitreaders--;
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_waitwriters > 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		rw->rw_waitwriters++;
+		wchan_lock(rw->rw_writewchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_writewchan);
+		spinlock_acquire(&rw->rw_lock);
+		rw->rw_waitwriters--;
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	if (rw->rw_waitwriters > 0 &&
+	    (!rw->rw_readerbias || rw->rw_waitreaders == 0)) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	else if (rw->rw_waitreaders > 0) {
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	return rw->rw_writer == curthread;
 }
@@ -35,6 +35,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
@@ -49,6 +51,8 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
+#include <irqtrace.h>
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
@@ -72,6 +76,8 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+static void thread_idle(void *unused1, unsigned long unused2);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +117,50 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Set up the fields of a thread that don't depend on where it came
+ * from. Shared by thread_create and by thread_pool_get, which hands
+ * out a recycled thread instead.
+ */
+static
+void
+thread_initfields(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+	thread->t_tid = 0;
+	thread->t_sleepkey = NULL;
+
+	/* Scheduler fields */
+	thread->t_mlfq_level = 0;
+	thread->t_mlfq_ticks = 0;
+	thread->t_pi_level = MLFQ_LEVELS;
+	thread->t_stride = thread_stride(0);
+	thread->t_pass = 0;
+	thread->t_cpumask = CPUMASK_ALL;
+	thread->t_handoff = NULL;
+	thread->t_handoffcpu = NULL;
+	thread->t_pi_blockedon = NULL;
+	thread->t_pi_waitlevel = 0;
+	thread->t_pi_locks = NULL;
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_intr_user = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -133,23 +183,8 @@ thread_create(const char *name)
 		kfree(thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
-
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
-
-	/* If you add to struct thread, be sure to initialize here */
+	thread_initfields(thread);
 
 	return thread;
 }
@@ -178,15 +213,30 @@ cpu_create(unsigned hardware_number)
 	c->c_hardware_number = hardware_number;
 
 	c->c_curthread = NULL;
+	c->c_idlethread = NULL;
+	c->c_leaving = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadpool);
 	c->c_hardclocks = 0;
+	callout_wheel_init(&c->c_callouts);
+	spinlock_nodes_init(c->c_spinnodes);
+	c->c_irqoff = true;	/* cpus start with interrupts off */
+	c->c_irqwindow = false;
 
 	c->c_isidle = false;
+	c->c_tickinterval = 1;
+	c->c_tickstart = 0;
+	c->c_tickcarry = 0;
 	threadlist_init(&c->c_runqueue);
+	c->c_pass = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_req = 0;
+	c->c_shootdown_done = 0;
+	c->c_ipi_sent = 0;
+	c->c_ipi_coalesced = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -222,6 +272,28 @@ cpu_create(unsigned hardware_number)
 	}
 	c->c_curthread->t_cpu = c;
 
+	/*
+	 * The idle thread starts out like a forked one, but is never
+	 * put on a run queue; thread_switch switches to it directly.
+	 */
+	snprintf(namebuf, sizeof(namebuf), "<idle #%d>", c->c_number);
+	c->c_idlethread = thread_create(namebuf);
+	if (c->c_idlethread == NULL) {
+		panic("cpu_create: thread_create failed\n");
+	}
+	c->c_idlethread->t_stack = kmalloc(STACK_SIZE);
+	if (c->c_idlethread->t_stack == NULL) {
+		panic("cpu_create: couldn't allocate stack");
+	}
+	thread_checkstack_init(c->c_idlethread);
+	result = proc_addthread(kproc, c->c_idlethread);
+	if (result) {
+		panic("cpu_create: proc_addthread:: %s\n", strerror(result));
+	}
+	c->c_idlethread->t_cpu = c;
+	c->c_idlethread->t_iplhigh_count++;
+	switchframe_init(c->c_idlethread, thread_idle, NULL, 0);
+
 	cpu_machdep_init(c);
 
 	return c;
@@ -262,9 +334,90 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Retired thread pool.
+ *
+ * Rather than freeing every zombie and allocating a fresh thread and
+ * stack for every thread_fork, each cpu keeps up to thread_pool_max
+ * dead threads with their stacks still attached and hands them back
+ * out. Besides saving two kmallocs and a kstrdup per fork, this keeps
+ * the stack pages around, so forking doesn't depend on finding a
+ * free page.
+ *
+ * The pool is only touched by its own cpu, with interrupts off (so
+ * exorcise() from a timer-driven switch can't trip over thread_fork).
+ */
+unsigned thread_pool_max = THREAD_POOL_DEFAULT;
+
+/*
+ * Put a zombie in the current cpu's pool. Returns false if it can't
+ * be kept (no stack to reuse, or the pool is full), in which case the
+ * caller should destroy it.
+ */
+static
+bool
+thread_pool_put(struct thread *z)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(z->t_proc == NULL);
+
+	if (z->t_stack == NULL ||
+	    curcpu->c_threadpool.tl_count >= thread_pool_max) {
+		return false;
+	}
+
+	thread_machdep_cleanup(&z->t_machdep);
+	z->t_wchan_name = "RETIRED";
+	threadlist_addtail(&curcpu->c_threadpool, z);
+	return true;
+}
+
+/*
+ * Get a thread out of the current cpu's pool and make it look like
+ * thread_create had just made it, with a stack. Returns NULL if the
+ * pool is empty (or, unusually, if the new name can't be stored).
+ */
+static
+struct thread *
+thread_pool_get(const char *name)
+{
+	struct thread *thread;
+	char *newname;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadpool);
+	splx(spl);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+	KASSERT(thread->t_state == S_ZOMBIE);
+	KASSERT(thread->t_stack != NULL);
+
+	/* Reuse the old name buffer if the new name fits. */
+	if (strlen(name) <= strlen(thread->t_name)) {
+		strcpy(thread->t_name, name);
+	}
+	else {
+		newname = kstrdup(name);
+		if (newname == NULL) {
+			thread_destroy(thread);
+			return NULL;
+		}
+		kfree(thread->t_name);
+		thread->t_name = newname;
+	}
+
+	thread_initfields(thread);
+	thread_checkstack_init(thread);
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Those we can recycle
+ * go in the pool instead.
  *
  * The list of zombies is per-cpu.
  */
@@ -277,7 +430,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_pool_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -427,34 +582,226 @@ thread_start_cpus(void)
 }
 
 /*
- * Make a thread runnable.
+ * Strides (see the scheduler notes below). A thread's stride is
+ * STRIDE_ONE divided by its tickets, and its pass goes up by its
+ * stride for every hardclock it runs. The tickets go up by a factor
+ * of 1.25 for each step of nice, as in Linux, so nice 0 against nice
+ * 10 is about 90% to 10%.
+ */
+#define STRIDE_ONE	(1U << 22)
+#define STRIDE_MAXLAG	8	/* Hardclocks of credit a thread can bank */
+
+static const unsigned stride_tickets[PRIO_MAX - PRIO_MIN + 1] = {
+	/* -20 */ 88818, 71054, 56843, 45475, 36380,
+	/* -15 */ 29104, 23283, 18626, 14901, 11921,
+	/* -10 */ 9537, 7629, 6104, 4883, 3906,
+	/*  -5 */ 3125, 2500, 2000, 1600, 1280,
+	/*   0 */ 1024, 819, 655, 524, 419,
+	/*   5 */ 336, 268, 215, 172, 137,
+	/*  10 */ 110, 88, 70, 56, 45,
+	/*  15 */ 36, 29, 23, 18, 15,
+	/*  20 */ 12,
+};
+
+unsigned
+thread_stride(int nice)
+{
+	KASSERT(nice >= PRIO_MIN && nice <= PRIO_MAX);
+	return STRIDE_ONE / stride_tickets[nice - PRIO_MIN];
+}
+
+/*
+ * Bring T's pass into line with cpu C, where it's about to be queued
+ * or run. Passes only mean something relative to the other threads
+ * on the same cpu: a thread that has been asleep, or comes from a
+ * cpu whose threads have run more or less, would otherwise get (or
+ * wait out) the difference all at once. So it starts no further
+ * behind than the furthest thread C has run, and no more than
+ * STRIDE_MAXLAG of its own hardclocks ahead of it.
+ *
+ * The run queue must be locked.
+ */
+static
+void
+thread_pass_clamp(struct cpu *c, struct thread *t)
+{
+	uint64_t limit;
+
+	if (t->t_pass < c->c_pass) {
+		t->t_pass = c->c_pass;
+	}
+	limit = c->c_pass + (uint64_t)STRIDE_MAXLAG * t->t_stride;
+	if (t->t_pass > limit) {
+		t->t_pass = limit;
+	}
+}
+
+/*
+ * Put a thread on a cpu's run queue. The queue is kept sorted by
+ * scheduling level (thread_level), highest priority (level 0) first,
+ * and by pass within each level, so thread_switch can just take the
+ * head. Scanning from the tail makes the common case -- a thread that
+ * has just run, so has the highest pass at its level -- O(1).
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * The run queue must be locked.
  */
 static
 void
+thread_runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct thread *prev;
+	unsigned level, prevlevel;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t->t_state = S_READY;
+	thread_pass_clamp(c, t);
+	level = thread_level(t);
+	THREADLIST_FORALL_REV(prev, c->c_runqueue) {
+		prevlevel = thread_level(prev);
+		if (prevlevel < level ||
+		    (prevlevel == level && prev->t_pass <= t->t_pass)) {
+			threadlist_insertafter(&c->c_runqueue, prev, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * Check T's affinity mask for cpu C.
+ */
+static
+bool
+thread_cpu_allowed(const struct thread *t, const struct cpu *c)
+{
+	return (t->t_cpumask & (1U << c->c_number)) != 0;
+}
+
+uint32_t
+thread_cpumask_online(void)
+{
+	uint32_t mask;
+	unsigned i, numcpus;
+
+	mask = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		mask |= 1U << cpuarray_get(&allcpus, i)->c_number;
+	}
+	return mask;
+}
+
+/*
+ * Choose a cpu for thread T that last ran on LAST (or, for a new
+ * thread, whose parent is on LAST): LAST itself if it's idle, since
+ * that keeps whatever cache state the thread still has; otherwise
+ * any idle cpu; otherwise whichever cpu has the least to do, counting
+ * the thread it's running, with ties going to LAST. Only cpus in T's
+ * affinity mask are considered.
+ *
+ * The idle flags and queue lengths are read without locks. They're
+ * only hints; a bad guess costs some latency, not correctness.
+ */
+static
+struct cpu *
+thread_place(struct thread *t, struct cpu *last)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus, load, bestload;
+
+	best = NULL;
+	bestload = 0;
+	if (thread_cpu_allowed(t, last)) {
+		if (last->c_isidle) {
+			return last;
+		}
+		best = last;
+		bestload = last->c_runqueue.tl_count + 1;
+	}
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == last || !thread_cpu_allowed(t, c)) {
+			continue;
+		}
+		if (c->c_isidle) {
+			return c;
+		}
+		load = c->c_runqueue.tl_count + 1;
+		if (best == NULL || load < bestload) {
+			best = c;
+			bestload = load;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
+/*
+ * Make a thread runnable.
+ *
+ * If the caller already holds the run queue lock of the thread's
+ * cpu (thread_switch requeueing curthread), it stays there.
+ * Otherwise, it's a wakeup or a new thread, and thread_place gets to
+ * pick a cpu for it.
+ *
+ * To move the thread we first lock the run queue of the cpu it last
+ * ran on. That cpu holds this lock across a context switch, so once
+ * we have it we know the thread has finished switching out and its
+ * saved context is safe to run elsewhere -- unless it's still that
+ * cpu's curthread, which happens when the cpu idled right after the
+ * thread went to sleep. Such a thread has to go back where it was.
+ *
+ * targetcpu might be curcpu; it might not be, too. It's returned,
+ * for thread_handoff_note.
+ */
+static
+struct cpu *
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
-	struct cpu *targetcpu;
+	struct cpu *targetcpu, *lastcpu;
 	bool isidle;
 
 	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
+	lastcpu = targetcpu = target->t_cpu;
 
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		spinlock_acquire(&lastcpu->c_runqueue_lock);
+		if (target != lastcpu->c_curthread) {
+			targetcpu = thread_place(target, lastcpu);
+		}
+		if (targetcpu != lastcpu) {
+			/*
+			 * Move t_cpu while we still hold the old cpu's
+			 * lock; see thread_set_pi_level.
+			 */
+			target->t_cpu = targetcpu;
+			spinlock_release(&lastcpu->c_runqueue_lock);
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-	if (isidle) {
+	thread_runqueue_insert(targetcpu, target);
+	if (targetcpu == curcpu->c_self) {
 		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
+		 * If we're idle, we're in an interrupt out of the idle
+		 * loop, which will find the thread when it returns.
+		 * Just make sure our own tick isn't stretched.
+		 */
+		hardclock_resume();
+	}
+	else if (isidle || targetcpu->c_tickinterval != 1) {
+		/*
+		 * Other processor is idle, or is running one thread
+		 * with its tick stretched out; send interrupt to
+		 * make sure it unidles and starts ticking again.
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
@@ -462,6 +809,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
+	return targetcpu;
 }
 
 /*
@@ -471,8 +819,9 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
  *
  * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * process is inherited from the caller. It starts on whichever CPU
+ * thread_place likes best, preferring idle ones, so a burst of forks
+ * spreads out over the machine instead of piling up on the caller's.
  */
 int
 thread_fork(const char *name,
@@ -487,24 +836,28 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	newthread = thread_pool_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
+	/* Where it last "ran"; thread_make_runnable may place it elsewhere */
 	newthread->t_cpu = curthread->t_cpu;
 
 	/* Attach the new thread to its process */
@@ -534,6 +887,240 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Thread migration.
+ *
+ * Done by pulling rather than pushing: a cpu that has run out of
+ * work takes a thread from the busiest other cpu just before it
+ * would go idle (see thread_switch). Busy cpus never have to stop to
+ * hand work out, and an idle cpu that misses out keeps its timer
+ * ticking while anyone has work queued (see hardclock_rearm), so it
+ * tries again within a few hardclocks instead of waiting for a
+ * periodic balancing pass.
+ *
+ * Migrating threads isn't free because of cache affinity, but
+ * System/161 doesn't model that, so we take the simple view that an
+ * idle cpu should always steal if it can.
+ *
+ * Called with our own run queue locked. The queue lengths are read
+ * without locks since they are only a hint, and the victim's lock is
+ * only ever try-locked: two idle cpus stealing from each other, or
+ * one stealing from a cpu in the middle of a wakeup, must not wait
+ * on each other with their own run queues held. If we lose a race we
+ * just go idle and try again at the next interrupt.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, count, best;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	victim = NULL;
+	best = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		count = c->c_runqueue.tl_count;
+		if (count > best) {
+			best = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	if (!spinlock_tryacquire(&victim->c_runqueue_lock)) {
+		return NULL;
+	}
+
+	/*
+	 * Take the last (lowest priority) thread that isn't the
+	 * victim's curthread and is allowed to run here. The victim's
+	 * curthread can briefly be on its own run queue while that
+	 * cpu is coming out of idle, and must not be moved out from
+	 * under it.
+	 */
+	THREADLIST_FORALL_REV(t, victim->c_runqueue) {
+		if (t != victim->c_curthread &&
+		    thread_cpu_allowed(t, curcpu->c_self)) {
+			break;
+		}
+	}
+	if (t == NULL) {
+		/* nothing we can take */
+		spinlock_release(&victim->c_runqueue_lock);
+		return NULL;
+	}
+
+	threadlist_remove(&victim->c_runqueue, t);
+	t->t_cpu = curcpu->c_self;
+	spinlock_release(&victim->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u\n",
+	      t->t_name, victim->c_number, curcpu->c_number);
+
+	return t;
+}
+
+/*
+ * Check whether thread_steal would find anything to try for. Like
+ * it, reads the other run queues without locks.
+ */
+bool
+thread_work_elsewhere(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_runqueue.tl_count > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Direct handoff.
+ *
+ * A thread that wakes another and then goes straight to sleep itself
+ * -- V followed by P, cv_signal followed by cv_wait, the usual shape
+ * of a request and its reply -- would otherwise leave the woken
+ * thread at the back of some run queue, or on another cpu that has
+ * to be interrupted out of idle, and its own cpu to pick whatever's
+ * at the head of its queue. Instead, single wakeups remember whom
+ * they woke and where they put it (t_handoff), and when the waker
+ * sleeps, thread_switch pulls that thread off its run queue and runs
+ * it next, right here.
+ *
+ * The hint is only good until the waker's next context switch, and
+ * is never dereferenced: it's used only if the thread is found, by
+ * address, on the run queue it was put on, which is locked while we
+ * look (only try-locked if it isn't ours, as in thread_steal). It
+ * also isn't taken if the queue has something at a better level, so
+ * handoff never runs a thread ahead of one the scheduler would have
+ * preferred.
+ */
+volatile bool thread_handoff_enabled = true;
+
+/*
+ * Called after waking TARGET onto TARGETCPU.
+ */
+static
+void
+thread_handoff_note(struct thread *target, struct cpu *targetcpu)
+{
+	/* Interrupt handlers wake threads for no thread in particular. */
+	if (curthread->t_in_interrupt) {
+		return;
+	}
+	curthread->t_handoff = target;
+	curthread->t_handoffcpu = targetcpu;
+}
+
+/*
+ * Called from thread_switch with our run queue locked, as CUR goes
+ * to sleep. Returns the thread to run next, or NULL to choose as
+ * usual.
+ */
+static
+struct thread *
+thread_handoff(struct thread *cur)
+{
+	struct thread *t, *iter;
+	struct cpu *c;
+	unsigned best;
+
+	t = cur->t_handoff;
+	c = cur->t_handoffcpu;
+	cur->t_handoff = NULL;
+	cur->t_handoffcpu = NULL;
+	if (t == NULL || !thread_handoff_enabled) {
+		return NULL;
+	}
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+	if (c != curcpu->c_self &&
+	    !spinlock_tryacquire(&c->c_runqueue_lock)) {
+		return NULL;
+	}
+
+	best = MLFQ_LEVELS;
+	THREADLIST_FORALL(iter, c->c_runqueue) {
+		if (best == MLFQ_LEVELS) {
+			/* The queue is sorted; the head is the best. */
+			best = thread_level(iter);
+		}
+		if (iter == t) {
+			break;
+		}
+	}
+	/*
+	 * Not there (any more), outranked, the other cpu's taking it,
+	 * or it may not run here.
+	 */
+	if (iter == NULL || thread_level(t) > best || t == c->c_curthread ||
+	    !thread_cpu_allowed(t, curcpu->c_self)) {
+		t = NULL;
+	}
+	else {
+		threadlist_remove(&c->c_runqueue, t);
+		t->t_cpu = curcpu->c_self;
+	}
+
+	if (c != curcpu->c_self) {
+		spinlock_release(&c->c_runqueue_lock);
+	}
+	return t;
+}
+
+/*
+ * Affinity.
+ *
+ * Each thread has a mask of the cpus it may run on (t_cpumask; see
+ * proc_setaffinity). Wakeups, new threads, stealing and handoff only
+ * ever put a thread on a cpu in its mask. A thread whose mask changes
+ * to leave out the cpu it's on moves the next time it gives up the
+ * cpu, which thread_hardclock makes the next hardclock at the latest.
+ *
+ * Moving is the awkward part, because we're running on the leaving
+ * thread's stack until we switch to something else, so it can't go on
+ * another cpu's run queue until then. Instead thread_switch parks it
+ * in c_leaving, and whatever runs next sends it on its way from the
+ * tail of thread_switch (or from thread_startup) with
+ * thread_make_runnable, which picks a cpu in its mask the same way a
+ * wakeup does. If there's nothing else to run, the cpu switches to its
+ * idle thread, which exists to give it a stack to do that on and to
+ * idle on afterwards.
+ */
+
+/*
+ * Called right after a context switch, with our run queue unlocked
+ * but interrupts still off.
+ */
+static
+void
+thread_leave_finish(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_leaving;
+	if (t != NULL) {
+		curcpu->c_leaving = NULL;
+		thread_make_runnable(t, false);
+	}
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -553,7 +1140,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	DEBUGASSERT(curcpu->c_curthread == curthread);
 	DEBUGASSERT(curthread->t_cpu == curcpu->c_self);
 
-	/* Explicitly disable interrupts on this processor */
+	/* Disable interrupts on this processor (lazily; see spl.c) */
 	spl = splhigh();
 
 	cur = curthread;
@@ -573,19 +1160,34 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. (Unless
+	 * we're not allowed here any more, and need to leave.)
+	 */
+	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue) &&
+	    thread_cpu_allowed(cur, curcpu->c_self)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
 	/* Put the thread in the right place. */
-	switch (newstate) {
+	if (cur == curcpu->c_idlethread) {
+		/* Parked; see thread_idle. */
+		KASSERT(newstate == S_SLEEP && wc == NULL);
+		cur->t_wchan_name = "IDLE";
+	}
+	else switch (newstate) {
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		if (thread_cpu_allowed(cur, curcpu->c_self)) {
+			thread_make_runnable(cur, true /*have lock*/);
+		}
+		else {
+			/* Off to another cpu; see thread_leave_finish. */
+			curcpu->c_leaving = cur;
+		}
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -629,18 +1231,48 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/* A thread going to sleep may have someone to hand off to. */
+	next = NULL;
+	if (newstate == S_SLEEP) {
+		next = thread_handoff(cur);
+	}
+	cur->t_handoff = NULL;
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
-	do {
+	while (next == NULL) {
 		next = threadlist_remhead(&curcpu->c_runqueue);
+		if (next == NULL) {
+			next = thread_steal();
+		}
+		if (next == NULL && curcpu->c_leaving != NULL) {
+			/* Can't idle on the stack of a thread that's leaving */
+			next = curcpu->c_idlethread;
+		}
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_IRQTRACE
+			/* Waiting for an interrupt isn't latency. */
+			irqtrace_on();
 			cpu_idle();
+			irqtrace_off();
+			irqtrace_site(__builtin_return_address(0));
+#else
+			cpu_idle();
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
-	} while (next == NULL);
+	}
+	/* Still idle as far as the tick goes; don't charge NEXT for it. */
+	hardclock_resume();
 	curcpu->c_isidle = false;
 
+	/* Stolen or handed-off threads come from elsewhere. */
+	thread_pass_clamp(curcpu, next);
+	if (next->t_pass > curcpu->c_pass) {
+		curcpu->c_pass = next->t_pass;
+	}
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -648,11 +1280,40 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * assume the compiler will optimize one away if they're the
 	 * same.
 	 */
-	curcpu->c_curthread = next;
-	curthread = next;
+	/*
+	 * A yielding thread that still outranks everything else on
+	 * the run queue comes straight back off it; in that case
+	 * there's nothing to switch.
+	 */
+	if (next != cur) {
+		/*
+		 * Count the switch. Giving up the cpu from inside an
+		 * interrupt means hardclock preempted us.
+		 */
+		if (newstate == S_READY && cur->t_in_interrupt) {
+			cur->t_usage.tu_nivcsw++;
+		}
+		else if (newstate != S_ZOMBIE) {
+			cur->t_usage.tu_nvcsw++;
+		}
+
+		/*
+		 * Our splhigh only turned interrupts off lazily (see
+		 * spl.c). From here until switchframe_switch loads
+		 * next's stack, curthread and the stack we're on
+		 * disagree, and a trap would land on the wrong one;
+		 * so turn them off for real. The splx at the end (or
+		 * spl0 in thread_startup) turns them back on.
+		 */
+		cpu_irqoff();
+		curcpu->c_irqoff = true;
 
-	/* do the switch (in assembler in switch.S) */
-	switchframe_switch(&cur->t_context, &next->t_context);
+		curcpu->c_curthread = next;
+		curthread = next;
+
+		/* do the switch (in assembler in switch.S) */
+		switchframe_switch(&cur->t_context, &next->t_context);
+	}
 
 	/*
 	 * When we get to this point we are either running in the next
@@ -708,6 +1369,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send off the thread we switched from, if it's leaving. */
+	thread_leave_finish();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -718,6 +1382,25 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	splx(spl);
 }
 
+/*
+ * Body of each cpu's idle thread. It's only switched to when a thread
+ * is leaving the cpu and nothing else is ready to run; thread_switch
+ * or thread_startup has sent the leaver off by the time we get here,
+ * so all there is to do is park again, and idle if there's still
+ * nothing to run.
+ */
+static
+void
+thread_idle(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		thread_switch(S_SLEEP, NULL);
+	}
+}
+
 /*
  * This function is where new threads start running. The arguments
  * ENTRYPOINT, DATA1, and DATA2 are passed through from thread_fork.
@@ -741,13 +1424,20 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send off the thread we switched from, if it's leaving. */
+	thread_leave_finish();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
 	/* Clean up dead threads. */
 	exorcise();
 
-	/* Enable interrupts. */
+	/*
+	 * Enable interrupts. thread_switch turned them off in the
+	 * processor on the way here, and set c_irqoff so this turns
+	 * them back on.
+	 */
 	spl0();
 
 #if OPT_SYNCHPROBS
@@ -799,6 +1489,10 @@ thread_exit(void)
 	/* Make sure we *are* detached (move this only if you're sure!) */
 	KASSERT(cur->t_proc == NULL);
 
+	/* And aren't holding or waiting for any contended locks */
+	KASSERT(cur->t_pi_locks == NULL);
+	KASSERT(cur->t_pi_blockedon == NULL);
+
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
@@ -822,139 +1516,194 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Multi-level feedback queue. Every thread has a level from 0
+ * (highest priority) to MLFQ_LEVELS-1; the run queue is kept sorted
+ * by level (see thread_runqueue_insert), and each level has its own
+ * time quantum, longer for the lower levels:
+ *
+ *    - a thread that uses up its quantum drops one level
+ *      (thread_hardclock);
+ *    - a thread that wakes up after sleeping on a wchan rises one
+ *      level (thread_mlfq_wakeup), so interactive and I/O-bound
+ *      threads stay near the top;
+ *    - every MLFQ_RESET_HARDCLOCKS everything on the cpu goes back
+ *      to level 0 (schedule), so CPU hogs parked at the bottom can't
+ *      be starved forever by a steady stream of busier threads.
+ *
+ * Quanta are in hardclocks.
+ *
+ * Within a level, threads get the cpu in proportion to their
+ * tickets, which come from their process's nice value (setpriority):
+ * stride scheduling. Each thread carries a pass that goes up by its
+ * stride, inversely proportional to its tickets, for every hardclock
+ * it runs, and a level is kept sorted by pass, so whoever has had the
+ * least for its share goes next. With everybody at nice 0 this is
+ * round robin, as before. The levels still come first, so an
+ * interactive thread at nice 10 still beats a hog at nice 0; what
+ * nice divides up is the time of threads competing at the same
+ * level, which for cpu-bound ones is nearly all of it. Each cpu
+ * schedules its own threads, so shares hold among the threads on
+ * one cpu, not across cpus.
  */
+#define MLFQ_RESET_HARDCLOCKS	100	/* Reset priorities every 100. */
+
+static const unsigned mlfq_quantum[MLFQ_LEVELS] = { 1, 2, 4, 8 };
 
+/*
+ * Called on a thread being woken from a wchan. The thread isn't on
+ * any cpu or list, so nobody else can be looking at its fields.
+ */
+static
 void
-schedule(void)
+thread_mlfq_wakeup(struct thread *t)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	if (t->t_mlfq_level > 0) {
+		t->t_mlfq_level--;
+		t->t_mlfq_ticks = 0;
+	}
 }
 
 /*
- * Thread migration.
+ * Charge the current thread for TICKS hardclocks (more than one if
+ * the tick was stretched; see hardclock). Called from hardclock() on
+ * every timer interrupt. Returns true if the thread should give
+ * up the cpu: either its quantum ran out (and it has been moved down
+ * a level) or something better is waiting on the run queue.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * The ticks also go on the thread's user or system time, depending on
+ * what the interrupt interrupted. This is sampling, as in classic
+ * Unix: the times are right on average, not for any one tick.
  */
-void
-thread_consider_migration(void)
+bool
+thread_hardclock(unsigned ticks)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct thread *cur = curthread;
+	struct thread *head;
+	bool preempt;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+	/* Nothing to charge if we interrupted the idle loop. */
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	/*
+	 * Nor if we caught this cpu's idle thread between switches.
+	 * It isn't a real thread: it has no share or level to keep,
+	 * and it may only leave the cpu by going back to sleep (see
+	 * the affinity notes), so it must never be preempted.
+	 */
+	if (cur == curcpu->c_idlethread) {
+		return false;
+	}
+
+	if (cur->t_intr_user) {
+		cur->t_usage.tu_utime += ticks;
+	}
+	else {
+		cur->t_usage.tu_stime += ticks;
+	}
+
+	cur->t_pass += (uint64_t)ticks * cur->t_stride;
+	cur->t_mlfq_ticks += ticks;
+	if (cur->t_mlfq_ticks >= mlfq_quantum[cur->t_mlfq_level]) {
+		if (cur->t_mlfq_level < MLFQ_LEVELS - 1) {
+			cur->t_mlfq_level++;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		cur->t_mlfq_ticks = 0;
+		return true;
+	}
+
+	/* We may not be allowed here any more. */
+	if (!thread_cpu_allowed(cur, curcpu->c_self)) {
+		return true;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	preempt = false;
+	if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		head = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		preempt = thread_level(head) < thread_level(cur);
 	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return preempt;
+}
+
+/*
+ * This is called periodically from hardclock(). Once every
+ * MLFQ_RESET_HARDCLOCKS it puts every thread on this cpu back at the
+ * top level. The run queue was sorted by level first and pass second;
+ * with the levels all the same, pass is all that counts, so the
+ * threads are taken off and put back on in their new order.
+ */
+void
+schedule(void)
+{
+	struct threadlist old;
+	struct thread *t;
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if ((curcpu->c_hardclocks % MLFQ_RESET_HARDCLOCKS) != 0) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
+	threadlist_init(&old);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+		threadlist_addtail(&old, t);
+	}
+	while ((t = threadlist_remhead(&old)) != NULL) {
+		t->t_mlfq_level = 0;
+		t->t_mlfq_ticks = 0;
+		thread_runqueue_insert(curcpu->c_self, t);
+	}
+	if (!curcpu->c_isidle && curthread != curcpu->c_idlethread) {
+		curthread->t_mlfq_level = 0;
+		curthread->t_mlfq_ticks = 0;
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&old);
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+unsigned
+thread_level(const struct thread *t)
+{
+	return t->t_pi_level < t->t_mlfq_level ?
+		t->t_pi_level : t->t_mlfq_level;
+}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+/*
+ * Change T's inherited level. T may be in any state, on any cpu; if
+ * it's sitting in a run queue (ready, and on a list) it's moved to
+ * its new place there. We lock the run queue of T's cpu and check
+ * that T didn't move away in the meantime: t_cpu is only ever changed
+ * by someone holding the run queue lock of the cpu it's changed
+ * *from*, so once we see it still naming the cpu whose lock we hold,
+ * it stays put until we let go. A thread being moved might not be on
+ * its new cpu's queue yet, but then it isn't on any list, and it gets
+ * inserted at whatever level we leave it.
+ */
+void
+thread_set_pi_level(struct thread *t, unsigned level)
+{
+	struct cpu *c;
+
+	KASSERT(level <= MLFQ_LEVELS);
+
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	t->t_pi_level = level;
+	if (t->t_state == S_READY && t->t_listnode.tln_next != NULL) {
+		threadlist_remove(&c->c_runqueue, t);
+		thread_runqueue_insert(c, t);
 	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	spinlock_release(&c->c_runqueue_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1025,9 +1774,84 @@ wchan_sleep(struct wchan *wc)
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
+	curthread->t_sleepkey = NULL;
+	thread_switch(S_SLEEP, wc);
+}
+
+/*
+ * Keyed sleeps, for channels shared among many objects (see sleepq.c).
+ * The sleeping thread remembers KEY, and the keyed wakeups below only
+ * pick threads that slept with the same key.
+ *
+ * Unlike wchan_wakeone and wchan_wakeall, the wakeups are called with
+ * the channel locked and leave it that way, since the channel's lock
+ * is usually also protecting the object the key belongs to. Threads
+ * are made runnable with it still held, which is the same order
+ * thread_switch takes the two locks in.
+ */
+void
+wchan_sleep_key(struct wchan *wc, const void *key)
+{
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(key != NULL);
+
+	curthread->t_sleepkey = key;
 	thread_switch(S_SLEEP, wc);
 }
 
+bool
+wchan_wakeone_key(struct wchan *wc, const void *key)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	THREADLIST_FORALL(target, wc->wc_threads) {
+		if (target->t_sleepkey == key) {
+			break;
+		}
+	}
+	if (target == NULL) {
+		return false;
+	}
+	threadlist_remove(&wc->wc_threads, target);
+
+	thread_mlfq_wakeup(target);
+	thread_handoff_note(target, thread_make_runnable(target, false));
+	return true;
+}
+
+void
+wchan_wakeall_key(struct wchan *wc, const void *key)
+{
+	struct thread *target;
+	struct threadlist list, others;
+
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	/* Sort the sleepers out, keeping the others in order. */
+	threadlist_init(&list);
+	threadlist_init(&others);
+	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		if (target->t_sleepkey == key) {
+			threadlist_addtail(&list, target);
+		}
+		else {
+			threadlist_addtail(&others, target);
+		}
+	}
+	while ((target = threadlist_remhead(&others)) != NULL) {
+		threadlist_addtail(&wc->wc_threads, target);
+	}
+	threadlist_cleanup(&others);
+
+	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_mlfq_wakeup(target);
+		thread_make_runnable(target, false);
+	}
+	threadlist_cleanup(&list);
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1050,7 +1874,8 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
-	thread_make_runnable(target, false);
+	thread_mlfq_wakeup(target);
+	thread_handoff_note(target, thread_make_runnable(target, false));
 }
 
 /*
@@ -1084,12 +1909,44 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_mlfq_wakeup(target);
 		thread_make_runnable(target, false);
 	}
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake up a particular thread, if it's sleeping on a wait channel.
+ */
+bool
+wchan_wakethread(struct wchan *wc, struct thread *t)
+{
+	struct thread *iter;
+	bool found;
+
+	found = false;
+	spinlock_acquire(&wc->wc_lock);
+	THREADLIST_FORALL(iter, wc->wc_threads) {
+		if (iter == t) {
+			found = true;
+			break;
+		}
+	}
+	if (found) {
+		threadlist_remove(&wc->wc_threads, t);
+	}
+	spinlock_release(&wc->wc_lock);
+
+	if (!found) {
+		return false;
+	}
+
+	thread_mlfq_wakeup(t);
+	thread_make_runnable(t, false);
+	return true;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1113,16 +1970,41 @@ wchan_isempty(struct wchan *wc)
  */
 
 /*
- * Send an IPI (inter-processor interrupt) to the specified CPU.
+ * Post IPI CODE to TARGET, whose IPI lock we hold.
+ *
+ * If TARGET already has pending bits, an IPI has been sent that it
+ * hasn't picked up yet: interprocessor_interrupt reads and clears
+ * the bits under the IPI lock, after the interrupt itself has been
+ * acknowledged. So the new bit will be seen when that one's handled,
+ * and sending another would only make the target take a second
+ * interrupt to find nothing to do. This is what keeps a burst of
+ * wakeups or shootdowns aimed at one cpu down to one IPI.
  */
+static
 void
-ipi_send(struct cpu *target, int code)
+ipi_post(struct cpu *target, int code)
 {
 	KASSERT(code >= 0 && code < 32);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
-	spinlock_acquire(&target->c_ipi_lock);
+	if (target->c_ipi_pending != 0) {
+		target->c_ipi_coalesced++;
+	}
+	else {
+		target->c_ipi_sent++;
+		mainbus_send_ipi(target);
+	}
 	target->c_ipi_pending |= (uint32_t)1 << code;
-	mainbus_send_ipi(target);
+}
+
+/*
+ * Send an IPI (inter-processor interrupt) to the specified CPU.
+ */
+void
+ipi_send(struct cpu *target, int code)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	ipi_post(target, code);
 	spinlock_release(&target->c_ipi_lock);
 }
 
@@ -1140,28 +2022,122 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Add MAPPING (NULL for everything) to TARGET's shootdown queue. IPI
+ * lock held.
+ */
+static
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+ipi_shootdown_queue(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	int n;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
+	target->c_shootdown_req++;
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* already flushing everything */
+	}
+	else if (n == TLBSHOOTDOWN_MAX || mapping == NULL) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
-
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	ipi_shootdown_queue(target, mapping);
+	ipi_post(target, IPI_TLBSHOOTDOWN);
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+		}
+	}
+}
+
+void
+ipi_tlbshootdown_broadcast_many(const struct tlbshootdown *mappings,
+				unsigned n)
+{
+	unsigned i, j;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		spinlock_acquire(&c->c_ipi_lock);
+		for (j=0; j<n; j++) {
+			ipi_shootdown_queue(c, &mappings[j]);
+		}
+		ipi_post(c, IPI_TLBSHOOTDOWN);
+		spinlock_release(&c->c_ipi_lock);
+	}
+}
+
+/*
+ * Wait for every cpu to catch up with the shootdowns posted to it so
+ * far. That includes this one, in case we moved after posting them;
+ * with interrupts on, its own IPI comes in while we spin.
+ */
+void
+ipi_tlbshootdown_wait(void)
+{
+	unsigned i, want;
+	struct cpu *c;
+	bool done;
+
+	KASSERT(curthread->t_iplhigh_count == 0);
+	KASSERT(!curthread->t_in_interrupt);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_ipi_lock);
+		want = c->c_shootdown_req;
+		spinlock_release(&c->c_ipi_lock);
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			/* (counters wrap) */
+			done = (int)(c->c_shootdown_done - want) >= 0;
+			spinlock_release(&c->c_ipi_lock);
+		} while (!done);
+	}
+}
+
+void
+ipi_printstats(void)
+{
+	unsigned i, sent, coalesced;
+	struct cpu *c;
+
+	kprintf("%-5s %10s %10s\n", "cpu", "sent", "coalesced");
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_ipi_lock);
+		sent = c->c_ipi_sent;
+		coalesced = c->c_ipi_coalesced;
+		spinlock_release(&c->c_ipi_lock);
+		kprintf("cpu%-2u %10u %10u\n", c->c_number, sent, coalesced);
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1189,7 +2165,9 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; restarting the tick is done below, since
+		 * the sender may be holding our run queue lock while
+		 * it waits for c_ipi_lock.
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
@@ -1202,8 +2180,15 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_req;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_UNIDLE)) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		hardclock_resume();
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 }
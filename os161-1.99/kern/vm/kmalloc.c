@@ -609,6 +609,16 @@ kmalloc(size_t sz)
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
 		if (address==0) {
+			/*
+			 * No physically contiguous run; piece one
+			 * together virtually instead. (A single page
+			 * never needs this, so kernel stacks stay
+			 * directly mapped.) kfree sends these back
+			 * through free_kpages, which knows them.
+			 */
+			if (npages > 1) {
+				return vmalloc(sz);
+			}
 			return NULL;
 		}
 
@@ -42,6 +42,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* uses struct timeval */
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -153,6 +154,17 @@ int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int getrusage(int who, struct rusage *usage);
+int getpriority(int which, pid_t who);
+int setpriority(int which, pid_t who, int prio);
+int getaffinity(pid_t pid, unsigned *mask);
+int setaffinity(pid_t pid, unsigned mask);
+int futex_wait(volatile int *addr, int val);
+int futex_wake(volatile int *addr, int n);
+int __thread_create(void (*entry)(void *, void *), void *a0, void *a1);
+int thread_join(int tid, void **retval);
+__DEAD void thread_exit(void *retval);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -163,5 +175,7 @@ int __getcwd(char *buf, size_t buflen);
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(void *(*func)(void *), void *arg); /* __thread_create */
+int nice(int incr);				/* calls [gs]etpriority */
 
 #endif /* _UNISTD_H_ */
@@ -0,0 +1,24 @@
+/*
+ * nice: add INCR to this process's nice value and return the new one.
+ * Since that may well be -1, callers who need to tell it from an
+ * error should clear errno beforehand and check it afterwards.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+
+int
+nice(int incr)
+{
+	int prio;
+
+	errno = 0;
+	prio = getpriority(PRIO_PROCESS, 0);
+	if (prio == -1 && errno != 0) {
+		return -1;
+	}
+	if (setpriority(PRIO_PROCESS, 0, prio + incr) < 0) {
+		return -1;
+	}
+	return getpriority(PRIO_PROCESS, 0);
+}
@@ -0,0 +1,161 @@
+/*
+ * User-level mutexes and condition variables. See <synch.h>.
+ *
+ * The mutex is the three-state one from Drepper's "Futexes Are
+ * Tricky": 0 is free, 1 is held, 2 is held and someone may be asleep
+ * waiting for it. Only a release from state 2 calls futex_wake, and
+ * a thread only sleeps after setting state 2, so the two can't miss
+ * each other.
+ *
+ * A condition variable is a sequence number. cond_wait reads it
+ * before releasing the mutex, and futex_wait then only sleeps if no
+ * signal has bumped it since. Woken waiters take the mutex in state
+ * 2, since they can't tell whether others are still waiting.
+ */
+
+#include <unistd.h>
+#include <synch.h>
+
+/* futex_wake count meaning "everyone" */
+#define WAKE_ALL	0x7fffffff
+
+/*
+ * Atomic operations, with load-linked/store-conditional.
+ */
+
+/* If *P is OLDVAL, make it NEWVAL. Returns what *P was. */
+static
+int
+atomic_cas(volatile int *p, int oldval, int newval)
+{
+	int x, y;
+
+	__asm volatile(
+		".set push;"
+		".set mips32;"
+		".set noreorder;"
+		"1: ll %0, 0(%2);"
+		"bne %0, %3, 2f;"
+		" move %1, %4;"
+		"sc %1, 0(%2);"
+		"beqz %1, 1b;"
+		" nop;"
+		"2:"
+		".set pop"
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (oldval), "r" (newval)
+		: "memory");
+	return x;
+}
+
+/* Set *P to NEWVAL. Returns what it was. */
+static
+int
+atomic_swap(volatile int *p, int newval)
+{
+	int x;
+
+	do {
+		x = *p;
+	} while (atomic_cas(p, x, newval) != x);
+	return x;
+}
+
+/* Add DELTA to *P. */
+static
+void
+atomic_add(volatile int *p, int delta)
+{
+	int x;
+
+	do {
+		x = *p;
+	} while (atomic_cas(p, x, x + delta) != x);
+}
+
+////////////////////////////////////////////////////////////
+
+void
+mutex_init(struct mutex *m)
+{
+	m->m_state = 0;
+}
+
+/*
+ * Take M, starting out by marking it contended. Used after a failed
+ * fast path, and by cond_wait.
+ */
+static
+void
+mutex_lock_slow(struct mutex *m)
+{
+	while (atomic_swap(&m->m_state, 2) != 0) {
+		futex_wait(&m->m_state, 2);
+	}
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	int c;
+
+	c = atomic_cas(&m->m_state, 0, 1);
+	if (c == 0) {
+		return;
+	}
+	mutex_lock_slow(m);
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	return atomic_cas(&m->m_state, 0, 1) == 0 ? 0 : -1;
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (atomic_swap(&m->m_state, 0) == 2) {
+		futex_wake(&m->m_state, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+void
+cond_init(struct cond *c)
+{
+	c->c_seq = 0;
+	c->c_waiters = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	int seq;
+
+	atomic_add(&c->c_waiters, 1);
+	seq = c->c_seq;
+	mutex_unlock(m);
+	futex_wait(&c->c_seq, seq);
+	atomic_add(&c->c_waiters, -1);
+	mutex_lock_slow(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+	if (c->c_waiters > 0) {
+		atomic_add(&c->c_seq, 1);
+		futex_wake(&c->c_seq, 1);
+	}
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+	if (c->c_waiters > 0) {
+		atomic_add(&c->c_seq, 1);
+		futex_wake(&c->c_seq, WAKE_ALL);
+	}
+}
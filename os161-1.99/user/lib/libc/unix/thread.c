@@ -0,0 +1,24 @@
+/*
+ * thread_create: start a new thread in this process running FUNC(ARG).
+ *
+ * The kernel starts the thread at thread_start, which calls FUNC and
+ * passes whatever it returns to thread_exit, so that returning from
+ * FUNC ends the thread the same way calling thread_exit does.
+ */
+
+#include <unistd.h>
+
+static
+void
+thread_start(void *func, void *arg)
+{
+	void *(*f)(void *) = (void *(*)(void *))func;
+
+	thread_exit(f(arg));
+}
+
+int
+thread_create(void *(*func)(void *), void *arg)
+{
+	return __thread_create(thread_start, (void *)func, arg);
+}
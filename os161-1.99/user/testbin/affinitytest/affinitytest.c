@@ -0,0 +1,221 @@
+/*
+ * affinitytest - test getaffinity/setaffinity.
+ *
+ * First the calls themselves: getaffinity starts out reporting every
+ * cpu, setaffinity takes masks naming at least one of them and
+ * rejects others, a forked child starts out with its parent's mask,
+ * and bad pids are rejected.
+ *
+ * Then, if there's more than one cpu, two hog processes spin for
+ * SPINSECS seconds of wall-clock time, first pinned to the same cpu
+ * and then to different ones, and report through their exit status
+ * how much cpu getrusage says they got, as a percentage of that.
+ * Sharing one cpu they should get about half each; on their own cpus,
+ * about all of it.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define SPINSECS	3
+#define SHARED_MAX	70	/* Most cpu% a hog may get sharing a cpu */
+#define ALONE_MIN	80	/* Least it may get on a cpu of its own */
+
+/*
+ * Time since the epoch, in milliseconds.
+ */
+static
+unsigned long long
+now_ms(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000 + nsecs / 1000000;
+}
+
+static
+unsigned
+getmask(pid_t pid)
+{
+	unsigned mask;
+
+	if (getaffinity(pid, &mask) < 0) {
+		err(1, "getaffinity");
+	}
+	return mask;
+}
+
+/*
+ * Returns the mask of all cpus.
+ */
+static
+unsigned
+test_calls(void)
+{
+	unsigned all, first, mask;
+	pid_t pid;
+	int r, status;
+
+	all = getmask(0);
+	if (all == 0) {
+		errx(1, "getaffinity: no cpus");
+	}
+	if (getmask(getpid()) != all) {
+		errx(1, "getaffinity by pid differs from getaffinity(0)");
+	}
+	first = all & -all;
+
+	if (setaffinity(0, first) < 0) {
+		err(1, "setaffinity");
+	}
+	mask = getmask(0);
+	if (mask != first) {
+		errx(1, "getaffinity: got 0x%x, expected 0x%x", mask, first);
+	}
+
+	r = setaffinity(0, 0);
+	if (r != -1 || errno != EINVAL) {
+		errx(1, "setaffinity with no cpus: got %d (errno %d)",
+		     r, errno);
+	}
+	if (all != 0xffffffff) {
+		r = setaffinity(0, ~all);
+		if (r != -1 || errno != EINVAL) {
+			errx(1, "setaffinity with only absent cpus: "
+			     "got %d (errno %d)", r, errno);
+		}
+	}
+	r = setaffinity(-5, all);
+	if (r != -1 || errno != ESRCH) {
+		errx(1, "setaffinity of pid -5: got %d (errno %d)", r, errno);
+	}
+	printf("getaffinity/setaffinity: ok (cpus 0x%x)\n", all);
+
+	/* Inherited across fork */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		_exit(getmask(0) == first ? 0 : 1);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child did not inherit affinity 0x%x", first);
+	}
+	printf("inherited across fork: ok\n");
+
+	if (setaffinity(0, all) < 0) {
+		err(1, "setaffinity");
+	}
+	return all;
+}
+
+/*
+ * Move to the cpus in MASK, spin until STOP, then exit with the
+ * percentage of the time since START that we got to run.
+ */
+static
+void
+hog(unsigned mask, unsigned long long start, unsigned long long stop)
+{
+	struct rusage ru;
+	unsigned long long ms;
+
+	if (setaffinity(0, mask) < 0) {
+		err(1, "setaffinity");
+	}
+	while (now_ms() < stop) {
+		/* spin */
+	}
+	if (getrusage(RUSAGE_SELF, &ru) < 0) {
+		err(1, "getrusage");
+	}
+	ms = ((unsigned long long)ru.ru_utime.tv_sec +
+	      ru.ru_stime.tv_sec) * 1000 +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+	_exit((int)(ms * 100 / (stop - start)));
+}
+
+/*
+ * Run two hogs on the cpus in MASK1 and MASK2, and return the smaller
+ * and larger of the shares they got.
+ */
+static
+void
+runhogs(unsigned mask1, unsigned mask2, int *lo, int *hi)
+{
+	unsigned masks[2];
+	pid_t pids[2];
+	int shares[2];
+	unsigned long long start, stop;
+	int i, status;
+
+	masks[0] = mask1;
+	masks[1] = mask2;
+	start = now_ms();
+	stop = start + SPINSECS * 1000;
+	for (i=0; i<2; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			hog(masks[i], start, stop);
+		}
+	}
+	for (i=0; i<2; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status)) {
+			errx(1, "hog %d did not exit normally", i);
+		}
+		shares[i] = WEXITSTATUS(status);
+	}
+	*lo = shares[0] < shares[1] ? shares[0] : shares[1];
+	*hi = shares[0] < shares[1] ? shares[1] : shares[0];
+}
+
+int
+main(void)
+{
+	unsigned all, cpu0, cpu1;
+	int lo, hi;
+
+	all = test_calls();
+
+	cpu0 = all & -all;
+	cpu1 = (all & ~cpu0) & -(all & ~cpu0);
+	if (cpu1 == 0) {
+		printf("Only one cpu; not testing placement.\n");
+		printf("affinitytest done.\n");
+		return 0;
+	}
+
+	runhogs(cpu0, cpu0, &lo, &hi);
+	printf("two hogs on cpu mask 0x%x: %d%% and %d%%\n", cpu0, lo, hi);
+	if (hi > SHARED_MAX) {
+		errx(1, "FAILED: a hog got %d%% of a cpu it should be "
+		     "sharing", hi);
+	}
+
+	runhogs(cpu0, cpu1, &lo, &hi);
+	printf("hogs on cpu masks 0x%x and 0x%x: %d%% and %d%%\n",
+	       cpu0, cpu1, lo, hi);
+	if (lo < ALONE_MIN) {
+		errx(1, "FAILED: a hog got only %d%% of a cpu of its own",
+		     lo);
+	}
+
+	printf("affinitytest done.\n");
+	return 0;
+}
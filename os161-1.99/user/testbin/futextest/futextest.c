@@ -0,0 +1,176 @@
+/*
+ * futextest - test futex_wait/futex_wake and the mutexes and
+ * condition variables built on them.
+ *
+ * First the single-threaded cases: futex_wait refuses to sleep when
+ * the value has changed, futex_wake with nobody waiting wakes nobody,
+ * bad addresses are rejected, and uncontended mutex and condition
+ * variable operations work.
+ *
+ * Then some threads fight over a mutex-protected counter, and pass a
+ * token around in turn with a condition variable.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <stdio.h>
+#include <synch.h>
+
+#define NTHREADS	4
+#define NINCS		20000
+#define NROUNDS		200
+
+static volatile int word;
+static struct mutex mtx = MUTEX_INITIALIZER;
+static struct cond cnd = COND_INITIALIZER;
+static volatile int counter;
+static volatile int turn;
+
+static
+void
+test_futex(void)
+{
+	int r;
+
+	word = 5;
+	r = futex_wait(&word, 6);
+	if (r != -1 || errno != EAGAIN) {
+		errx(1, "futex_wait with stale value: got %d (errno %d)",
+		     r, errno);
+	}
+
+	r = futex_wake(&word, 1);
+	if (r != 0) {
+		errx(1, "futex_wake with no waiters: woke %d", r);
+	}
+
+	r = futex_wait((volatile int *)((char *)&word + 1), 5);
+	if (r != -1 || errno != EINVAL) {
+		errx(1, "futex_wait on misaligned address: got %d", r);
+	}
+
+	r = futex_wait((volatile int *)0x40000000, 0);
+	if (r != -1 || errno != EFAULT) {
+		errx(1, "futex_wait on bad address: got %d", r);
+	}
+	printf("futex_wait/futex_wake: ok\n");
+}
+
+static
+void
+test_mutex(void)
+{
+	int i;
+
+	for (i=0; i<1000; i++) {
+		mutex_lock(&mtx);
+		if (mtx.m_state != 1) {
+			errx(1, "mutex_lock: state %d", mtx.m_state);
+		}
+		if (mutex_trylock(&mtx) == 0) {
+			errx(1, "mutex_trylock succeeded on held mutex");
+		}
+		mutex_unlock(&mtx);
+		if (mtx.m_state != 0) {
+			errx(1, "mutex_unlock: state %d", mtx.m_state);
+		}
+	}
+
+	/* Nobody waiting, so these must not block or call the kernel. */
+	mutex_lock(&mtx);
+	cond_signal(&cnd);
+	cond_broadcast(&cnd);
+	mutex_unlock(&mtx);
+	if (cnd.c_seq != 0) {
+		errx(1, "cond_signal with no waiters changed the sequence");
+	}
+	printf("mutex/cond: ok\n");
+}
+
+static
+void *
+incthread(void *junk)
+{
+	int i;
+
+	(void)junk;
+	for (i=0; i<NINCS; i++) {
+		mutex_lock(&mtx);
+		counter++;
+		mutex_unlock(&mtx);
+	}
+	return NULL;
+}
+
+static
+void *
+turnthread(void *arg)
+{
+	int me = (int)arg;
+	int i;
+
+	for (i=0; i<NROUNDS; i++) {
+		mutex_lock(&mtx);
+		while (turn % NTHREADS != me) {
+			cond_wait(&cnd, &mtx);
+		}
+		turn++;
+		cond_broadcast(&cnd);
+		mutex_unlock(&mtx);
+	}
+	return arg;
+}
+
+static
+void
+runthreads(void *(*func)(void *))
+{
+	int i, tids[NTHREADS];
+	void *ret;
+
+	for (i=0; i<NTHREADS; i++) {
+		tids[i] = thread_create(func, (void *)i);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], &ret)) {
+			err(1, "thread_join");
+		}
+		if (func == turnthread && ret != (void *)i) {
+			errx(1, "thread %d returned %p", i, ret);
+		}
+	}
+}
+
+static
+void
+test_threads(void)
+{
+	counter = 0;
+	runthreads(incthread);
+	if (counter != NTHREADS * NINCS) {
+		errx(1, "counter is %d, should be %d", counter,
+		     NTHREADS * NINCS);
+	}
+	printf("contended mutex: ok\n");
+
+	turn = 0;
+	runthreads(turnthread);
+	if (turn != NTHREADS * NROUNDS) {
+		errx(1, "turn is %d, should be %d", turn, NTHREADS * NROUNDS);
+	}
+	printf("condition variable: ok\n");
+}
+
+int
+main(void)
+{
+	test_futex();
+	test_mutex();
+	test_threads();
+	printf("futextest: passed\n");
+	return 0;
+}
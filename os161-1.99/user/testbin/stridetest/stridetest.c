@@ -0,0 +1,253 @@
+/*
+ * stridetest - test setpriority/getpriority/nice and the proportional
+ * share they buy.
+ *
+ * Usage: stridetest [nice ...]
+ *
+ * First the calls themselves: values are clamped to PRIO_MIN..PRIO_MAX,
+ * nice adds to the current value, bad arguments are rejected, and a
+ * forked child starts out with its parent's value.
+ *
+ * Then one hog process per argument (default: one at nice 0, one at
+ * nice 10) spins for SPINSECS seconds of wall-clock time, and reports
+ * through its exit status how much cpu getrusage says it got, as a
+ * percentage of that. The shares of the total should come out in
+ * proportion to the tickets each nice value is worth: the tickets go
+ * up by a factor of 1.25 for each step down in nice, so nice 0 against
+ * nice 10 should be about 90% to 10%.
+ *
+ * The kernel shares out each cpu separately, so the share check only
+ * means something with one cpu. If the hogs between them got more
+ * than one cpu's worth, the test says so and skips the check.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define MAXHOGS		8
+#define SPINSECS	5
+#define TOLERANCE	10	/* Percentage points either way */
+
+/*
+ * Time since the epoch, in milliseconds.
+ */
+static
+unsigned long long
+now_ms(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000 + nsecs / 1000000;
+}
+
+/*
+ * Tickets for a nice value, as the kernel figures them, give or take
+ * rounding.
+ */
+static
+unsigned long long
+tickets(int nice)
+{
+	unsigned long long t = 1024ULL << 10;
+
+	for (; nice > 0; nice--) {
+		t = t * 4 / 5;
+	}
+	for (; nice < 0; nice++) {
+		t = t * 5 / 4;
+	}
+	return t;
+}
+
+static
+void
+test_calls(void)
+{
+	pid_t pid;
+	int r, status;
+
+	if (setpriority(PRIO_PROCESS, 0, 3) < 0) {
+		err(1, "setpriority");
+	}
+	r = getpriority(PRIO_PROCESS, 0);
+	if (r != 3) {
+		errx(1, "getpriority: got %d, expected 3", r);
+	}
+	r = getpriority(PRIO_PROCESS, getpid());
+	if (r != 3) {
+		errx(1, "getpriority by pid: got %d, expected 3", r);
+	}
+
+	r = nice(2);
+	if (r != 5) {
+		errx(1, "nice(2) from 3: got %d", r);
+	}
+	r = nice(-7);
+	if (r != -2) {
+		errx(1, "nice(-7) from 5: got %d", r);
+	}
+
+	setpriority(PRIO_PROCESS, 0, PRIO_MAX + 100);
+	r = getpriority(PRIO_PROCESS, 0);
+	if (r != PRIO_MAX) {
+		errx(1, "setpriority above PRIO_MAX: got %d", r);
+	}
+	setpriority(PRIO_PROCESS, 0, PRIO_MIN - 100);
+	r = getpriority(PRIO_PROCESS, 0);
+	if (r != PRIO_MIN) {
+		errx(1, "setpriority below PRIO_MIN: got %d", r);
+	}
+
+	r = setpriority(PRIO_PGRP, 0, 0);
+	if (r != -1 || errno != EINVAL) {
+		errx(1, "setpriority(PRIO_PGRP): got %d (errno %d)", r, errno);
+	}
+	r = setpriority(PRIO_PROCESS, -5, 0);
+	if (r != -1 || errno != ESRCH) {
+		errx(1, "setpriority of pid -5: got %d (errno %d)", r, errno);
+	}
+	printf("setpriority/getpriority/nice: ok\n");
+
+	/* Inherited across fork */
+	setpriority(PRIO_PROCESS, 0, 7);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		_exit(getpriority(PRIO_PROCESS, 0) == 7 ? 0 : 1);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child did not inherit nice value 7");
+	}
+	setpriority(PRIO_PROCESS, 0, 0);
+	printf("inherited across fork: ok\n");
+}
+
+/*
+ * Spin until STOP, then exit with the percentage of the time since
+ * START that we got to run.
+ */
+static
+void
+hog(int nice, unsigned long long start, unsigned long long stop)
+{
+	struct rusage ru;
+	unsigned long long ms;
+
+	if (setpriority(PRIO_PROCESS, 0, nice) < 0) {
+		err(1, "setpriority");
+	}
+	while (now_ms() < stop) {
+		/* spin */
+	}
+	if (getrusage(RUSAGE_SELF, &ru) < 0) {
+		err(1, "getrusage");
+	}
+	ms = ((unsigned long long)ru.ru_utime.tv_sec +
+	      ru.ru_stime.tv_sec) * 1000 +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+	_exit((int)(ms * 100 / (stop - start)));
+}
+
+static
+int
+test_shares(int nhogs, const int *nices)
+{
+	pid_t pids[MAXHOGS];
+	int shares[MAXHOGS];
+	unsigned long long start, stop, totaltickets;
+	int i, status, total, got, expected, failed;
+
+	start = now_ms();
+	stop = start + SPINSECS * 1000;
+	for (i=0; i<nhogs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			hog(nices[i], start, stop);
+		}
+	}
+
+	total = 0;
+	for (i=0; i<nhogs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status)) {
+			errx(1, "hog %d did not exit normally", i);
+		}
+		shares[i] = WEXITSTATUS(status);
+		total += shares[i];
+	}
+	if (total == 0) {
+		errx(1, "the hogs got no cpu time at all");
+	}
+
+	totaltickets = 0;
+	for (i=0; i<nhogs; i++) {
+		totaltickets += tickets(nices[i]);
+	}
+
+	failed = 0;
+	printf("%4s %6s %9s %9s\n", "nice", "cpu%", "share%", "expected%");
+	for (i=0; i<nhogs; i++) {
+		got = shares[i] * 100 / total;
+		expected = (int)(tickets(nices[i]) * 100 / totaltickets);
+		printf("%4d %6d %9d %9d\n", nices[i], shares[i], got, expected);
+		if (got < expected - TOLERANCE || got > expected + TOLERANCE) {
+			failed = 1;
+		}
+	}
+
+	if (total > 150) {
+		printf("The hogs got %d%% of a cpu between them, so they "
+		       "ran on more than one cpu;\nnot checking the "
+		       "shares.\n", total);
+		return 0;
+	}
+	return failed;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nices[MAXHOGS];
+	int nhogs, i;
+
+	if (argc - 1 > MAXHOGS) {
+		errx(1, "Usage: stridetest [nice ...] (at most %d)", MAXHOGS);
+	}
+	if (argc > 1) {
+		nhogs = argc - 1;
+		for (i=0; i<nhogs; i++) {
+			nices[i] = atoi(argv[i+1]);
+		}
+	}
+	else {
+		nhogs = 2;
+		nices[0] = 0;
+		nices[1] = 10;
+	}
+
+	test_calls();
+
+	if (test_shares(nhogs, nices)) {
+		errx(1, "FAILED: shares off by more than %d points",
+		     TOLERANCE);
+	}
+	printf("stridetest done.\n");
+	return 0;
+}
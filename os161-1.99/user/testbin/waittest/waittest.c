@@ -0,0 +1,235 @@
+/*
+ * waittest - test waitpid.
+ *
+ * Checks that waitpid hands back the exit status a child passed to
+ * _exit, that WNOHANG returns 0 while a child is still running and
+ * its pid once it has exited, that a child can only be collected once
+ * and only by its own parent, that WAIT_ANY collects whichever child
+ * exits, and that a process whose parent exited first doesn't get in
+ * anyone's way.
+ *
+ * Then it forks and collects NCHILDREN children in batches of BATCH,
+ * so a few hundred processes go through fork, _exit and waitpid.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define NCHILDREN	400
+#define BATCH		50
+
+static
+pid_t
+spawn(int code)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		_exit(code);
+	}
+	return pid;
+}
+
+static
+int
+collect(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid) {
+		err(1, "waitpid %d", pid);
+	}
+	if (!WIFEXITED(status)) {
+		errx(1, "pid %d did not exit normally", pid);
+	}
+	return WEXITSTATUS(status);
+}
+
+static
+void
+test_status(void)
+{
+	pid_t pid;
+	int r, status;
+
+	pid = spawn(42);
+	r = collect(pid);
+	if (r != 42) {
+		errx(1, "exit status: got %d, expected 42", r);
+	}
+
+	r = waitpid(pid, &status, 0);
+	if (r != -1 || errno != ECHILD) {
+		errx(1, "second waitpid: got %d (errno %d)", r, errno);
+	}
+	r = waitpid(getpid(), &status, 0);
+	if (r != -1 || errno != ECHILD) {
+		errx(1, "waitpid on self: got %d (errno %d)", r, errno);
+	}
+	r = waitpid(pid, &status, 12345);
+	if (r != -1 || errno != EINVAL) {
+		errx(1, "waitpid with bad options: got %d (errno %d)",
+		     r, errno);
+	}
+
+	/* status may be NULL */
+	pid = spawn(0);
+	if (waitpid(pid, NULL, 0) != pid) {
+		err(1, "waitpid with NULL status");
+	}
+	printf("exit status: ok\n");
+}
+
+/*
+ * The child spins for a second or two, which should be plenty of time
+ * to find it still running.
+ */
+static
+void
+test_wnohang(void)
+{
+	time_t start, now;
+	unsigned long nsecs;
+	pid_t pid;
+	int r, status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		__time(&start, &nsecs);
+		do {
+			__time(&now, &nsecs);
+		} while (now < start + 2);
+		_exit(7);
+	}
+
+	r = waitpid(pid, &status, WNOHANG);
+	if (r != 0) {
+		errx(1, "WNOHANG on running child: got %d", r);
+	}
+	do {
+		r = waitpid(pid, &status, WNOHANG);
+	} while (r == 0);
+	if (r != pid) {
+		err(1, "waitpid WNOHANG");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 7) {
+		errx(1, "WNOHANG status: got 0x%x", status);
+	}
+	printf("WNOHANG: ok\n");
+}
+
+static
+void
+test_any(void)
+{
+	pid_t pids[3], pid;
+	int i, j, seen, status;
+
+	for (i=0; i<3; i++) {
+		pids[i] = spawn(i);
+	}
+	seen = 0;
+	for (i=0; i<3; i++) {
+		pid = waitpid(WAIT_ANY, &status, 0);
+		if (pid < 0) {
+			err(1, "waitpid WAIT_ANY");
+		}
+		for (j=0; j<3 && pids[j] != pid; j++);
+		if (j == 3 || WEXITSTATUS(status) != j) {
+			errx(1, "WAIT_ANY collected pid %d status %d",
+			     pid, WEXITSTATUS(status));
+		}
+		seen |= 1 << j;
+	}
+	if (seen != 7) {
+		errx(1, "WAIT_ANY missed a child");
+	}
+	if (waitpid(WAIT_ANY, &status, 0) != -1 || errno != ECHILD) {
+		errx(1, "WAIT_ANY with no children didn't fail with ECHILD");
+	}
+	printf("WAIT_ANY: ok\n");
+}
+
+/*
+ * A child forks a grandchild and exits; the grandchild outlives it.
+ * The grandchild isn't ours, so there should be nothing to wait for.
+ */
+static
+void
+test_orphan(void)
+{
+	pid_t pid, grandchild;
+	int r, status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		grandchild = fork();
+		if (grandchild < 0) {
+			_exit(255);
+		}
+		if (grandchild == 0) {
+			/* Hang around long enough to be orphaned */
+			for (r=0; r<1000; r++) {
+				getpid();
+			}
+			_exit(0);
+		}
+		_exit(0);
+	}
+	r = collect(pid);
+	if (r == 255) {
+		errx(1, "fork in child failed");
+	}
+
+	r = waitpid(WAIT_ANY, &status, WNOHANG);
+	if (r != -1 || errno != ECHILD) {
+		errx(1, "waitpid found someone else's child: got %d", r);
+	}
+	printf("orphans: ok\n");
+}
+
+static
+void
+test_many(void)
+{
+	pid_t pids[BATCH];
+	int i, j;
+
+	for (i=0; i<NCHILDREN; i+=BATCH) {
+		for (j=0; j<BATCH; j++) {
+			pids[j] = spawn(j);
+		}
+		for (j=BATCH-1; j>=0; j--) {
+			if (collect(pids[j]) != j) {
+				errx(1, "child %d: wrong exit status", i + j);
+			}
+		}
+	}
+	printf("%d children forked and collected: ok\n", NCHILDREN);
+}
+
+int
+main(void)
+{
+	test_status();
+	test_wnohang();
+	test_any();
+	test_orphan();
+	test_many();
+	printf("waittest done.\n");
+	return 0;
+}